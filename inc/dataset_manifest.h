@@ -0,0 +1,99 @@
+#ifndef DATASET_MANIFEST_H
+#define DATASET_MANIFEST_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Binary index of the images and packs under a dataset root, stored next to it as <root>.LFM.
+// Directories are scanned once, later lookups only rescan the ones whose mtime changed.
+// A file rewritten in place under the same name does not touch its directory, so its record
+// keeps the size and mtime of the previous content: readers that depend on the content
+// (ImageDependencies, ImageStore) stat the file themselves.
+class DatasetManifest
+{
+public:
+	struct Record
+	{
+		std::string name; // File name inside its directory
+		int32_t classId;  // Directory, relative to the root
+		int32_t groupId;  // An image and the transformations generated from it
+		int32_t variantId; // 0 for the group head, otherwise its suffix (T1..T6, T)
+		int32_t number;   // "(N)" of the file name
+		int64_t size;
+		int64_t mtime;
+	};
+
+	static const std::string Extension;
+
+	static void Open(const std::string& root, bool readOnly = false);
+	static void Close();
+	static std::vector<std::string> Directories();
+	static std::vector<Record> GetRecords(const std::string& directoryPath);
+	static std::string Variant(int32_t variantId);
+	static void Invalidate(const std::string& directoryPath);
+
+private:
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t directoryCount;
+		uint32_t variantCount;
+		uint64_t recordCount;
+		uint64_t stringsSize;
+	};
+
+	struct DirectoryEntry
+	{
+		uint64_t pathOffset;
+		uint32_t pathLength;
+		uint32_t recordCount;
+		int64_t mtime;
+	};
+
+	struct VariantEntry
+	{
+		uint64_t nameOffset;
+		uint32_t nameLength;
+		uint32_t reserved;
+	};
+
+	struct RecordEntry
+	{
+		uint64_t nameOffset;
+		uint32_t nameLength;
+		int32_t classId;
+		int32_t groupId;
+		int32_t variantId;
+		int32_t number;
+		uint32_t reserved;
+		int64_t size;
+		int64_t mtime;
+	};
+
+	struct Directory
+	{
+		std::string path;
+		int64_t mtime;
+		std::vector<Record> records;
+	};
+
+	static std::mutex mutex;
+	static std::string root;
+	static std::vector<Directory> directories;
+	static std::vector<std::string> variants;
+	static bool changed;
+	static bool readOnly; // Loaded and refreshed in memory, never saved
+
+	static bool Load();
+	static void Save();
+	static bool Refresh(size_t directory);
+	static std::vector<Record> Scan(const std::string& directoryPath, std::vector<std::string>* subdirectories);
+	static bool RelativePath(const std::string& directoryPath, std::string& path);
+	static int32_t FindDirectory(const std::string& directoryPath);
+	static int32_t VariantId(const std::string& variant);
+	static int64_t DirectoryTime(const std::string& directoryPath);
+};
+
+#endif
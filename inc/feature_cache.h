@@ -0,0 +1,54 @@
+#ifndef FEATURE_CACHE_H
+#define FEATURE_CACHE_H
+
+#include <opencv2/opencv.hpp>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+// Append-only file of feature rows, keyed by the content hash of a view and the extractor settings.
+// Rows of previous runs are read from a private memory mapping.
+class FeatureCache
+{
+public:
+	static const uint32_t Version = 1; // Bump when a feature extractor changes
+
+	static void Open(const std::string& cachePath);
+	static void Close();
+	static uint64_t Key(uint64_t contentHash, size_t view);
+	static bool Get(uint64_t key, std::vector<double>& features);
+	static void Put(uint64_t key, const std::vector<double>& features);
+	static std::vector<double> Extract(uint64_t contentHash, size_t view, const std::function<cv::Mat()>& load);
+	static std::vector<double> Extract(const std::string& filePath, size_t view);
+	static std::vector<double> Extract(const std::string& filePath, const std::vector<uchar>& data, size_t view);
+	static bool GetLeafMask(uint64_t contentHash, cv::Size& size, cv::Rect& box, cv::Mat& mask);
+	static void PutLeafMask(uint64_t contentHash, cv::Size size, const cv::Rect& box, const cv::Mat& mask);
+
+private:
+	static uint64_t LeafMaskKey(uint64_t contentHash);
+	static size_t CompleteSize(int fd, size_t fileSize);
+
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t reserved;
+	};
+
+	struct Row
+	{
+		uint64_t key;
+		uint32_t count;
+		uint32_t reserved;
+	};
+
+	static std::mutex mutex;
+	static std::string path;
+	static uchar* mapping;
+	static size_t mappingSize;
+	static size_t validSize;
+	static std::unordered_map<uint64_t, std::pair<const double*, uint32_t>> index;
+	static std::unordered_map<uint64_t, std::vector<double>> pending;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef FEATURE_MATRIX_H
+#define FEATURE_MATRIX_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+// Samples as rows of one aligned, row-major buffer, with the class id of each row.
+// Rows are padded to a whole cache line so every row starts aligned.
+class FeatureMatrix
+{
+public:
+	static const size_t Alignment = 64;
+
+	// Strided view over one feature of every row
+	class Column
+	{
+	public:
+		Column(const double* data, size_t stride, size_t rows) : data(data), stride(stride), rows(rows) {}
+		double operator[](size_t row) const { return data[row * stride]; }
+		size_t size() const { return rows; }
+
+	private:
+		const double* data;
+		size_t stride;
+		size_t rows;
+	};
+
+	FeatureMatrix() = default;
+	FeatureMatrix(size_t rows, size_t cols);
+	FeatureMatrix(FeatureMatrix&&) = default;
+	FeatureMatrix& operator=(FeatureMatrix&&) = default;
+	FeatureMatrix(const FeatureMatrix&) = delete;
+	FeatureMatrix& operator=(const FeatureMatrix&) = delete;
+
+	void Resize(size_t rows, size_t cols);
+	void Append(std::span<const double> features, uint8_t classId);
+	void Truncate(size_t cols);
+
+	size_t Rows() const { return rows; }
+	size_t Cols() const { return cols; }
+	size_t Stride() const { return stride; }
+	bool Empty() const { return rows == 0; }
+	std::span<double> Row(size_t row) { return {data.get() + row * stride, cols}; }
+	std::span<const double> Row(size_t row) const { return {data.get() + row * stride, cols}; }
+	Column Col(size_t col) const { return Column(data.get() + col, stride, rows); }
+	uint8_t& ClassId(size_t row) { return classIds[row]; }
+	uint8_t ClassId(size_t row) const { return classIds[row]; }
+
+private:
+	struct Free
+	{
+		void operator()(double* pointer) const { std::free(pointer); }
+	};
+
+	void Reserve(size_t capacity);
+
+	size_t rows = 0;
+	size_t cols = 0;
+	size_t stride = 0;
+	size_t capacity = 0;
+	std::unique_ptr<double[], Free> data;
+	std::vector<uint8_t> classIds;
+};
+
+#endif
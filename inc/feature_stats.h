@@ -0,0 +1,42 @@
+#ifndef FEATURE_STATS_H
+#define FEATURE_STATS_H
+
+#include "feature_matrix.h"
+#include <string>
+
+// Running mean and variance of every feature (Welford), mergeable across threads and processes
+class FeatureStats
+{
+public:
+	static const std::string Extension;
+
+	FeatureStats() = default;
+
+	static FeatureStats Compute(const FeatureMatrix& matrix);
+	static FeatureStats Load(const std::string& filename);
+	void Save(const std::string& filename) const;
+
+	void Add(std::span<const double> features);
+	void Merge(const FeatureStats& other);
+
+	uint64_t Count() const { return count; }
+	size_t Cols() const { return means.size(); }
+	double Mean(size_t col) const { return means[col]; }
+	double StdDev(size_t col) const;
+
+private:
+	// Header, then the means and the sums of squared differences of featureCount features
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t count;
+		uint64_t featureCount;
+	};
+
+	uint64_t count = 0;
+	std::vector<double> means;
+	std::vector<double> squaredDiffs;
+};
+
+#endif
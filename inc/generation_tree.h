@@ -0,0 +1,29 @@
+#ifndef GENERATION_TREE_H
+#define GENERATION_TREE_H
+
+#include <string>
+#include <thread>
+
+// Generated images live apart from the sources, one directory tree per generation:
+// <root>/.generated/<generation>/<class>/. The "current" link names the published one
+// and is replaced by an atomic rename, older generations are removed in the background.
+// A generation being built holds an advisory lock on <generation>.lock until it is
+// published, so a concurrent run never reclaims it. Every generating run builds a new
+// generation, the images of unchanged samples are hard links into the published one.
+class GenerationTree
+{
+public:
+	static const std::string Directory;
+
+	static std::string Current(const std::string& root);
+	static std::string Create(const std::string& root);
+	static void Publish(const std::string& root, const std::string& generation);
+	static void Reclaim(const std::string& root);
+	static void Wait();
+
+private:
+	static std::thread reclaimer;
+	static int lock; // Of the generation this process builds, -1 when none
+};
+
+#endif
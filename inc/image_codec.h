@@ -0,0 +1,39 @@
+#ifndef IMAGE_CODEC_H
+#define IMAGE_CODEC_H
+
+#include <opencv2/opencv.hpp>
+
+// Encoding of pipeline-internal images, JPEG is kept for deliverables
+class ImageCodec
+{
+public:
+	enum class Format
+	{
+		Jpeg,
+		Png,
+		Raw,
+		Qoi
+	};
+
+	static const std::vector<Format> formats;
+
+	static Format ParseFormat(const std::string& name);
+	static std::string Name(Format format);
+	static std::string Extension(Format format);
+	static bool IsImageExtension(const std::string& extension);
+
+	static std::vector<uchar> Encode(const cv::Mat& image, Format format, int jpegQuality = 95);
+	static cv::Mat Decode(const uchar* data, size_t size, int flags = cv::IMREAD_COLOR);
+	static cv::Mat DecodeRegion(const uchar* data, size_t size, const cv::Rect& region);
+	static void Write(const std::string& filePath, const cv::Mat& image, Format format, int jpegQuality = 95);
+	static cv::Mat Read(const std::string& filePath, int flags = cv::IMREAD_COLOR);
+
+private:
+	static std::vector<uchar> EncodeRaw(const cv::Mat& image);
+	static cv::Mat DecodeRaw(const uchar* data, size_t size);
+	static std::vector<uchar> EncodeQoi(const cv::Mat& image);
+	static cv::Mat DecodeQoi(const uchar* data, size_t size);
+	static cv::Mat DecodeJpegRegion(const uchar* data, size_t size, const cv::Rect& region);
+};
+
+#endif
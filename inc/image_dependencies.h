@@ -0,0 +1,70 @@
+#ifndef IMAGE_DEPENDENCIES_H
+#define IMAGE_DEPENDENCIES_H
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Generated images of a directory, keyed by the content hash of their input and the settings that shaped them.
+// Stored per directory so an unchanged sample is not generated twice.
+class ImageDependencies
+{
+public:
+	static const std::string FileName;
+
+	static uint64_t Hash(const void* data, size_t size, uint64_t hash = 14695981039346656037ull);
+	static uint64_t Hash(const std::string& text, uint64_t hash = 14695981039346656037ull);
+	static uint64_t HashFile(const std::string& filePath);
+	static std::vector<bool> Outdated(const std::string& directoryPath, const std::vector<std::string>& inputs, char stage, const std::vector<uint64_t>& configHashes);
+	static void Update(const std::string& directoryPath, const std::string& input, char stage, uint64_t configHash, const std::vector<std::string>& outputs);
+	static void Save(const std::string& directoryPath);
+	static std::unordered_set<std::string> Sweep(const std::string& directoryPath, char stage);
+	static size_t Carry(const std::string& previousPath, const std::string& directoryPath);
+
+private:
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t count;
+		uint64_t stringsSize;
+	};
+
+	struct Entry
+	{
+		uint64_t inputOffset;
+		uint32_t inputLength;
+		uint32_t stage;
+		uint64_t outputsOffset;
+		uint32_t outputsLength;
+		uint32_t reserved;
+		int64_t size;
+		int64_t mtime;
+		uint64_t contentHash;
+		uint64_t configHash;
+	};
+
+	struct Dependency
+	{
+		std::string input;
+		char stage;
+		std::vector<std::string> outputs;
+		int64_t size;
+		int64_t mtime;
+		uint64_t contentHash;
+		uint64_t configHash;
+		bool used; // Checked or updated during this run
+	};
+
+	typedef std::unordered_map<std::string, Dependency> Directory;
+
+	static std::mutex mutex;
+	static std::unordered_map<std::string, Directory> directories;
+
+	static Directory& Load(const std::string& directoryPath);
+	static void Stat(const std::string& filePath, int64_t& size, int64_t& mtime);
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef IMAGE_PACK_H
+#define IMAGE_PACK_H
+
+#include "image_codec.h"
+
+#include <opencv2/opencv.hpp>
+
+// Single file holding every plane of a sample, behind an index header
+class ImagePack
+{
+public:
+	static const std::string Extension;
+
+	// Planes with an encoded payload are stored as they are instead of being encoded again
+	static void Save(const std::string& filePath, const std::vector<cv::Mat>& images, const std::vector<std::string>& names, ImageCodec::Format format, const std::vector<std::vector<uchar>>& encoded = {});
+	static std::vector<cv::Mat> Load(const std::string& filePath, std::vector<std::string>& names, std::vector<std::vector<uchar>>* payloads = nullptr);
+	static size_t Count(const std::string& filePath);
+	static std::vector<cv::Mat> Decode(const uchar* data, size_t size, std::vector<std::string>& names, const std::string& filePath, std::vector<std::vector<uchar>>* payloads = nullptr);
+	static cv::Mat Get(const std::vector<cv::Mat>& images, const std::vector<std::string>& names, const std::string& name);
+
+private:
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t count;
+		uint32_t reserved;
+	};
+
+	struct Entry
+	{
+		char name[16];
+		int32_t rows;
+		int32_t cols;
+		int32_t type;
+		uint32_t reserved;
+		uint64_t offset;
+		uint64_t size;
+	};
+};
+
+#endif
@@ -6,6 +6,19 @@
 class ImageProcessing
 {
 public:
+	enum class Segmentation
+	{
+		Heuristic,
+		ExcessGreen,
+		ExcessGreenRed
+	};
+
+	static int orbFeatures; // Maximum number of ORB keypoints
+	static bool keyPointFeatures; // Describe the ORB view by keypoint statistics
+	static const size_t ORBView = 4; // Index of T4 in an image group (original, T1..T6)
+	static Segmentation segmentation; // Leaf mask algorithm
+	static int segmentationScale; // Downsampling factor of the heuristic leaf mask
+
 	static void Rotate(cv::Mat& image, double minDistr, double maxDistr);
 	static void Distort(cv::Mat& image);
 	static void Flip(cv::Mat& image);
@@ -19,12 +32,29 @@ public:
 	static void EqualizeHistogramValue(cv::Mat& image);
 	static void DetectORBKeyPoints(cv::Mat& image);
 
+	static Segmentation ParseSegmentation(const std::string& name);
+	static std::string FeatureSettings();
+	static void ApplyFeatureSettings(const std::string& settings);
+	static std::string ParseFeatureArgument(int argc, char* argv[], int& i);
+	static cv::Mat ExtractLeafMask(const cv::Mat& image);
+	static cv::Mat ExtractLeafMask(const cv::Mat& image, Segmentation mode, int scale);
+	static cv::Rect LeafBoundingBox(const cv::Mat& mask);
+	static cv::Mat RescaleLeafRegion(const cv::Mat& region, const cv::Mat& regionMask, cv::Size size);
+	static void RescaleLeaf(cv::Mat& image, const cv::Mat& mask);
 	static void ExtractLeafAndRescale(cv::Mat& image);
 
 	static std::vector<double> ExtractTextureCaracteristics(const cv::Mat& image);
 	static std::vector<double> ExtractColorCaracteristics(const cv::Mat& image);
+	static std::vector<double> ExtractKeyPointCaracteristics(const cv::Mat& image);
+	static std::vector<double> ExtractCaracteristics(const cv::Mat& image, size_t view);
 
 private :
+	static cv::Ptr<cv::ORB>& GetORBDetector();
+	static void ApplyFeatureSetting(const std::string& key, const std::string& value);
+	static bool IsLeafPixel(const cv::Vec3b& pixel);
+	static cv::Mat HeuristicLeafMask(const cv::Mat& image, int erosionSize);
+	static void RefineMaskBorder(const cv::Mat& image, cv::Mat& mask, int band, int erosionSize);
+	static cv::Mat VegetationIndexLeafMask(const cv::Mat& image, Segmentation mode, int erosionSize);
 	static cv::Mat CalculateGLCM(const cv::Mat& img);
 	static std::vector<double> ExtractGLCMFeatures(const cv::Mat& glcm);
 };
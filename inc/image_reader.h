@@ -0,0 +1,23 @@
+#ifndef IMAGE_READER_H
+#define IMAGE_READER_H
+
+#include <opencv2/opencv.hpp>
+#include <functional>
+
+// Whole files of a batch read into preallocated buffers, to be decoded from memory.
+// Reads are submitted together through io_uring when liburing is available, on one ring
+// per reading thread, otherwise the kernel is asked to prefetch them with posix_fadvise.
+class ImageReader
+{
+public:
+	static const size_t QueueDepth = 64;
+
+	static std::vector<std::vector<uchar>> Read(const std::vector<std::string>& filePaths);
+	static void ForEachBatch(const std::vector<std::string>& filePaths, size_t batchSize, const std::function<void(size_t first, std::vector<std::vector<uchar>>& buffers)>& process);
+
+private:
+	static bool ReadUring(const std::vector<std::string>& filePaths, const std::vector<int>& fds, std::vector<std::vector<uchar>>& buffers);
+	static void ReadPrefetched(const std::vector<std::string>& filePaths, const std::vector<int>& fds, std::vector<std::vector<uchar>>& buffers);
+};
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef IMAGE_STORE_H
+#define IMAGE_STORE_H
+
+#include <opencv2/opencv.hpp>
+#include <unordered_map>
+
+// Decoded, size-normalized source images behind an offset index.
+// Entries are returned as cv::Mat headers over a read-only shared memory mapping,
+// callers that modify an image work on a clone.
+class ImageStore
+{
+public:
+	static void Build(const std::string& storePath, const std::vector<std::string>& imagePaths, cv::Size size);
+	static void Open(const std::string& storePath);
+	static void Close();
+	static cv::Mat Get(const std::string& imagePath, int flags = cv::IMREAD_COLOR);
+
+private:
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t count;
+		int32_t rows;
+		int32_t cols;
+		uint64_t dataOffset;
+	};
+
+	struct Entry
+	{
+		uint64_t pathOffset;
+		uint32_t pathLength;
+		uint32_t valid;
+		int64_t size;
+		int64_t mtime;
+		uint64_t offset;
+	};
+
+	static const uchar* mapping;
+	static size_t mappingSize;
+	static cv::Size imageSize;
+	static std::unordered_map<std::string, const Entry*> index;
+
+	static std::string Key(const std::string& imagePath);
+	static void Stat(const std::string& imagePath, int64_t& size, int64_t& mtime);
+};
+
+#endif
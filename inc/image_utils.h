@@ -1,17 +1,25 @@
 #ifndef IMAGE_UTILS_H
 #define IMAGE_UTILS_H
 
+#include "image_codec.h"
+
 #include <opencv2/opencv.hpp>
+#include <filesystem>
 
 class ImageUtils {
 public:
 	static std::mutex mutex; // Mutex for thread-safe updates
 	static int progress;
 	static int numComplete;
+	static bool packed; // Store generated planes of a sample in a single image pack
+	static ImageCodec::Format format; // Format of generated images
 
+	static bool IsGeneratedImage(const std::filesystem::path& path);
+	static cv::Mat ReadImage(const std::string& filePath, int flags = cv::IMREAD_COLOR);
 	static void ShowMosaic(const std::vector<cv::Mat>& images, const std::string& name, const std::vector<std::string>& labels);
-	static void SaveImages(const std::string& filePath, const std::vector<cv::Mat>& images, const std::vector<std::string>& types);
-	static std::vector<std::string> GetImagesInDirectory(const std::string& directoryPath, int generation);
+	static std::vector<std::string> SaveImages(const std::string& filePath, const std::vector<cv::Mat>& images, const std::vector<std::string>& types);
+	static std::string SavePack(const std::string& filePath, const std::vector<cv::Mat>& images, const std::vector<std::string>& types, const std::string& suffix, const std::vector<std::vector<uchar>>& payloads = {});
+	static std::vector<std::string> GetImagesInDirectory(const std::string& directoryPath, int generation, const std::string& extension = "");
 	static void SaveTFromToDirectory(const std::string& source, const std::string& destination, int generation);
 	static void SaveAFromToDirectory(const std::string& source, const std::string& destination, int generation);
 };
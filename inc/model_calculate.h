@@ -2,57 +2,73 @@
 #define MODEL_CALCULATE_H
 
 #include <vector>
+#include <span>
 #include <unordered_map>
 #include <string>
 
-struct DataEntry;
+#include "model_utils.h"
 
 class ModelCalculate
 {
 public:
+	enum class Optimizer
+	{
+		Gradient,
+		Momentum,
+		Adam,
+		AdaGrad
+	};
+
+	static ModelUtils::ModelType modelType;
+	static Optimizer optimizer;
+	static size_t epochs;
+	static size_t batchSize; // 0 for full-batch steps
+	static double learningRate;
+
+	static Optimizer ParseOptimizer(const std::string& name);
+
 	static void GenerateModels(
-		std::vector<DataEntry>& database,
+		FeatureMatrix& database,
+		const FeatureStats& stats,
 		std::vector<std::vector<double>>& weights,
 		std::vector<double>& featureMeans,
 		std::vector<double>& featureStdDevs);
 
 	static double LogisticRegressionHypothesis(
-		const std::vector<double>& weights,
-		const std::vector<double>& inputs);
+		std::span<const double> weights,
+		std::span<const double> inputs);
 private:
 
 	static std::vector<double> Accuracy(
-		const std::vector<std::vector<double>>& inputs,
-		const std::vector<std::vector<double>>& types,
+		const FeatureMatrix& inputs,
+		const std::vector<size_t>& rows,
 		const std::vector<std::vector<double>>& weights);
 
-	static double LossFunction(
-		const std::vector<std::vector<double>>& inputs,
-		const std::vector<std::vector<double>>& weights,
-		const std::vector<std::vector<double>>& target,
-		const size_t type);
+	// Per-weight history of the adaptive optimizers
+	struct OptimizerState
+	{
+		std::vector<double> velocity;
+		std::vector<double> squares;
+		size_t steps = 0;
+	};
 
-	static double LossFunctionPartialDerivative(
-		const std::vector<std::vector<double>>& inputs,
+	static std::vector<double> GradientDescent(
+		const FeatureMatrix& inputs,
+		std::span<const size_t> rows,
 		std::vector<std::vector<double>>& weights,
-		const std::vector<std::vector<double>>& target,
-		const size_t type, const size_t j);
+		OptimizerState& state);
 
-	static void GradientDescent(
-		const std::vector<std::vector<double>>& inputs,
+	static void UpdateWeights(
 		std::vector<std::vector<double>>& weights,
-		const std::vector<std::vector<double>>& target,
-		const size_t type);
+		const std::vector<double>& gradient,
+		OptimizerState& state);
 
 	static void LogisticRegressionTargetsOneHotTraining(
 		std::vector<std::vector<double>>& weights,
-		const std::vector<std::vector<double>>& trainInputs,
-		const std::vector<std::vector<double>>& validInputs,
-		const std::vector<std::vector<double>>& trainTargetsOneHot,
-		const std::vector<std::vector<double>>& validTargetsOneHot,
+		const FeatureMatrix& inputs,
+		const std::vector<size_t>& trainRows,
+		const std::vector<size_t>& validRows,
 		const size_t epochs);
 };
 
 #endif
-
-
@@ -5,46 +5,117 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
-
-struct DataEntry {
-	size_t index;
-	std::string target;
-	std::vector<double> features;
-};
+#include "feature_matrix.h"
+#include "feature_stats.h"
 
 class ModelUtils {
 public:
+	// One-vs-rest sigmoid models, or a single multinomial softmax model
+	enum class ModelType {
+		Sigmoid,
+		Softmax
+	};
+
 	static const std::vector<std::string> targets;
+	static const std::string DatasetExtension;
+
+	static bool IsDataset(const std::string& filename);
+
+	static void LoadDataset(
+		FeatureMatrix& database,
+		const std::string& filename,
+		std::string& featureSettings);
+
+	static void SaveDataset(
+		const std::string& filename,
+		const FeatureMatrix& database,
+		bool singlePrecision = false,
+		const std::string& featureSettings = "");
 
 	static void LoadDataFile(
-		std::vector<DataEntry>& database,
+		FeatureMatrix& database,
 		const std::string& filename);
 
 	static void SaveDataFile(
 		const std::string& filename,
-		const std::vector<DataEntry>& database);
+		const FeatureMatrix& database);
 
 	static void NormalizationZScore(
-		std::vector<DataEntry>& data,
+		FeatureMatrix& database,
+		const FeatureStats& stats,
 		std::vector<double>& featureMeans,
 		std::vector<double>& featureStdDevs);
 
 	static void SetupTrainingData(
-		const std::vector<DataEntry>& database,
-		std::vector<std::vector<double>>& weights,
-		std::vector<std::vector<double>>& trainInputs,
-		std::vector<std::vector<double>>& trainTargetsOneHot);
+		const FeatureMatrix& database,
+		std::vector<std::vector<double>>& weights);
+
+	static uint8_t ClassId(const std::string& target);
 
 	static std::string SaveModels(
 		const std::vector<std::vector<double>>& weights,
 		const std::vector<double>& featureMeans,
-		const std::vector<double>& featureStdDevs);
+		const std::vector<double>& featureStdDevs,
+		ModelType modelType = ModelType::Sigmoid,
+		const std::string& featureSettings = "");
 
 	static void LoadModels(
 		std::vector<std::vector<double>>& weights,
 		std::vector<double>& featureMeans,
 		std::vector<double>& featureStdDevs,
+		ModelType& modelType,
+		std::string& featureSettings,
 		const std::string& filename);
+
+private:
+	friend class DatasetWriter;
+
+	static const char* MapFile(const std::string& filename, size_t& size);
+
+	// Header, class table, feature settings the rows were extracted with (version 3), then blocks of
+	// blockRows rows: their features followed by their class ids.
+	// rowCount only covers written blocks, a file cut short loads up to its last block.
+	struct DatasetHeader {
+		char magic[4];
+		uint32_t version;
+		uint64_t rowCount;
+		uint32_t featureCount;
+		uint32_t valueSize; // 4 for float32, 8 for float64
+		uint32_t classCount;
+		uint32_t blockRows;
+		uint64_t featuresOffset;
+		uint64_t blockSize;
+	};
+};
+
+// Rows streamed to <filename>.tmp, a block at a time, and renamed to <filename> by Close().
+// A failed run leaves the previous dataset untouched; the header of the temporary file is
+// rewritten after each block, so the rows it holds stay loadable from it.
+class DatasetWriter {
+public:
+	static const size_t BlockRows = 1024;
+
+	DatasetWriter(const std::string& filename, bool singlePrecision = false, const std::string& featureSettings = "");
+	~DatasetWriter();
+	DatasetWriter(const DatasetWriter&) = delete;
+	DatasetWriter& operator=(const DatasetWriter&) = delete;
+
+	void Append(std::span<const double> features, uint8_t classId);
+	void Close();
+	size_t Rows() const { return this->rows + this->pending; }
+	const FeatureStats& Stats() const { return this->stats; }
+
+private:
+	void WriteBlock();
+
+	std::string filename;
+	int fd;
+	ModelUtils::DatasetHeader header;
+	std::vector<char> block;
+	std::vector<double> stored; // Row rounded to float32, as the statistics see it
+	FeatureStats stats;
+	size_t rows = 0;
+	size_t pending = 0;
 };
 
 #endif
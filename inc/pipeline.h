@@ -0,0 +1,165 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Multi-producer multi-consumer queue, Push blocks while the queue is full
+template <typename T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+	bool Push(T item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [&]
+					 { return closed || items.size() < capacity; });
+		if (closed)
+		{
+			return false;
+		}
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+
+	// False once the queue is closed and drained
+	bool Pop(T &item)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [&]
+					  { return closed || !items.empty(); });
+		if (items.empty())
+		{
+			return false;
+		}
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	void Close()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+	std::deque<T> items;
+	size_t capacity;
+	bool closed = false;
+};
+
+// Read, process and write stages, each with its own threads, connected by bounded queues
+class Pipeline
+{
+public:
+	template <typename Input, typename Output>
+	static void Run(
+		size_t count,
+		size_t readers, size_t workers, size_t writers, size_t capacity,
+		const std::function<Input(size_t)> &read,
+		const std::function<Output(Input &)> &process,
+		const std::function<void(Output &)> &write)
+	{
+		BoundedQueue<Input> inputs(capacity);
+		BoundedQueue<Output> outputs(capacity);
+		std::atomic<size_t> next(0);
+		std::atomic<size_t> activeReaders(readers);
+		std::atomic<size_t> activeWorkers(workers);
+		std::exception_ptr error;
+		std::mutex errorMutex;
+
+		// First exception stops every stage
+		auto fail = [&]()
+		{
+			{
+				std::lock_guard<std::mutex> lock(errorMutex);
+				if (!error)
+				{
+					error = std::current_exception();
+				}
+			}
+			next = count;
+			inputs.Close();
+			outputs.Close();
+		};
+
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < readers; i++)
+		{
+			threads.emplace_back([&]()
+								 {
+				try {
+					for (size_t index = next++; index < count; index = next++) {
+						if (!inputs.Push(read(index))) {
+							break;
+						}
+					}
+				}
+				catch (...) {
+					fail();
+				}
+				if (--activeReaders == 0) {
+					inputs.Close();
+				} });
+		}
+		for (size_t i = 0; i < workers; i++)
+		{
+			threads.emplace_back([&]()
+								 {
+				try {
+					Input input;
+					while (inputs.Pop(input)) {
+						if (!outputs.Push(process(input))) {
+							break;
+						}
+					}
+				}
+				catch (...) {
+					fail();
+				}
+				if (--activeWorkers == 0) {
+					outputs.Close();
+				} });
+		}
+		for (size_t i = 0; i < writers; i++)
+		{
+			threads.emplace_back([&]()
+								 {
+				try {
+					Output output;
+					while (outputs.Pop(output)) {
+						write(output);
+					}
+				}
+				catch (...) {
+					fail();
+				} });
+		}
+		for (auto &thread : threads)
+		{
+			thread.join();
+		}
+		if (error)
+		{
+			std::rethrow_exception(error);
+		}
+	}
+};
+
+#endif
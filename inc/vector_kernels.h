@@ -0,0 +1,16 @@
+#ifndef VECTOR_KERNELS_H
+#define VECTOR_KERNELS_H
+
+#include <cstddef>
+
+// Dense kernels over contiguous doubles, vectorized with OpenMP SIMD.
+// On x86-64 an AVX2 version is selected at load time when the CPU has it.
+class VectorKernels
+{
+public:
+	static double Dot(const double* a, const double* b, size_t size);
+	static void Axpy(double alpha, const double* x, double* y, size_t size);
+	static void Gemv(const double* matrix, size_t rows, size_t cols, const double* x, double* y);
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include "image_processing.h"
 #include "image_utils.h"
+#include "dataset_manifest.h"
 
 #include <iostream>
 #include <filesystem>
@@ -33,7 +34,7 @@ void display(const std::string &source)
 	cv::waitKey(0);
 }
 
-void augmentation(const std::string &source, const std::string &destination, int generation)
+void augmentation(const std::string &source, const std::string &destination, int generation, ImageCodec::Format format)
 {
 	// Check if destination already exists
 	if (std::filesystem::exists(destination))
@@ -82,8 +83,8 @@ void augmentation(const std::string &source, const std::string &destination, int
 		const std::string imgName = destinationPath.substr(lastSlashPos + 1, lastPointPos - lastSlashPos - 1);
 		for (size_t i = 0; i < images.size(); i++)
 		{
-			const std::string outputFilename = saveDir + imgName + "_" + augmentations[i] + ".JPG";
-			cv::imwrite(outputFilename, images[i], {cv::IMWRITE_JPEG_QUALITY, 100});
+			const std::string outputFilename = saveDir + imgName + "_" + augmentations[i] + ImageCodec::Extension(format);
+			ImageCodec::Write(outputFilename, images[i], format, 100);
 			std::cout << "\r\033[K"
 					  << "Saved : " << outputFilename << std::flush;
 		}
@@ -105,7 +106,7 @@ int main(int argc, char *argv[])
 	{
 		if (argc < 2)
 		{
-			throw std::runtime_error("Usage: " + (std::string)argv[0] + " <source_path> -dst <destination_path> -gen <num_generations>");
+			throw std::runtime_error("Usage: " + (std::string)argv[0] + " <source_path> -dst <destination_path> -gen <num_generations> -fmt <jpg|png|raw|qoi>");
 		}
 		// Apple_Black_rot     620 files
 		// Apple_healthy       1640 files
@@ -118,6 +119,7 @@ int main(int argc, char *argv[])
 		std::string source = argv[1];
 		std::string destination = "images/augmented_directory/";
 		int generation = 1640;
+		ImageCodec::Format format = ImageCodec::Format::Jpeg;
 
 		// Parse command-line arguments
 		for (int i = 1; i < argc; ++i)
@@ -137,9 +139,14 @@ int main(int argc, char *argv[])
 				}
 				++i;
 			}
+			else if (arg == "-fmt" && i + 1 < argc)
+			{
+				format = ImageCodec::ParseFormat(argv[i + 1]);
+				++i;
+			}
 			else if (arg == "-h")
 			{
-				std::cout << "Usage: " << argv[0] << " <source_path> -dst <destination_path> -gen <num_generations>" << std::endl;
+				std::cout << "Usage: " << argv[0] << " <source_path> -dst <destination_path> -gen <num_generations> -fmt <jpg|png|raw|qoi>" << std::endl;
 				return 0;
 			}
 		}
@@ -157,7 +164,9 @@ int main(int argc, char *argv[])
 			{
 				destination += "/";
 			}
-			augmentation(source, destination, generation);
+			DatasetManifest::Open(source);
+			augmentation(source, destination, generation, format);
+			DatasetManifest::Close();
 		}
 	}
 	catch (const std::exception &e)
@@ -0,0 +1,135 @@
+#include "image_codec.h"
+#include "image_utils.h"
+
+#include <iostream>
+#include <chrono>
+
+std::vector<cv::Mat> loadImages(const std::string &source, int count)
+{
+	std::vector<cv::Mat> images;
+	for (const auto &name : ImageUtils::GetImagesInDirectory(source, count, ".JPG"))
+	{
+		cv::Mat image = cv::imread(source + name);
+		if (image.empty())
+		{
+			throw std::runtime_error("Unable to load the image. " + source + name);
+		}
+		images.push_back(image);
+	}
+	if (images.empty())
+	{
+		throw std::runtime_error("No image in " + source);
+	}
+	return images;
+}
+
+void benchmarkCodecs(const std::vector<cv::Mat> &images, int repeat)
+{
+	double pixelBytes = 0.0;
+	for (const auto &image : images)
+	{
+		pixelBytes += image.total() * image.elemSize();
+	}
+	pixelBytes *= repeat;
+
+	std::cout << std::left << std::setw(8) << "Format"
+			  << std::setw(16) << "Encode (MB/s)"
+			  << std::setw(16) << "Decode (MB/s)"
+			  << std::setw(16) << "Encode (img/s)"
+			  << std::setw(16) << "Decode (img/s)"
+			  << std::setw(10) << "Ratio" << std::endl;
+	for (const ImageCodec::Format format : ImageCodec::formats)
+	{
+		std::vector<std::vector<uchar>> buffers(images.size());
+		double encodedBytes = 0.0;
+
+		// Encode
+		auto start_time = std::chrono::high_resolution_clock::now();
+		for (int r = 0; r < repeat; r++)
+		{
+			for (size_t i = 0; i < images.size(); i++)
+			{
+				buffers[i] = ImageCodec::Encode(images[i], format);
+			}
+		}
+		auto end_time = std::chrono::high_resolution_clock::now();
+		const double encodeTime = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count() * 0.000001;
+		for (const auto &buffer : buffers)
+		{
+			encodedBytes += buffer.size();
+		}
+
+		// Decode
+		start_time = std::chrono::high_resolution_clock::now();
+		for (int r = 0; r < repeat; r++)
+		{
+			for (const auto &buffer : buffers)
+			{
+				if (ImageCodec::Decode(buffer.data(), buffer.size()).empty())
+				{
+					throw std::runtime_error("Unable to decode " + ImageCodec::Name(format));
+				}
+			}
+		}
+		end_time = std::chrono::high_resolution_clock::now();
+		const double decodeTime = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count() * 0.000001;
+
+		const double numImages = static_cast<double>(images.size()) * repeat;
+		std::cout << std::left << std::setw(8) << ImageCodec::Name(format) << std::fixed << std::setprecision(1)
+				  << std::setw(16) << pixelBytes / encodeTime / 1e6
+				  << std::setw(16) << pixelBytes / decodeTime / 1e6
+				  << std::setw(16) << numImages / encodeTime
+				  << std::setw(16) << numImages / decodeTime
+				  << std::setprecision(2) << std::setw(10) << pixelBytes / (encodedBytes * repeat) << std::endl;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		if (argc < 3)
+		{
+			throw std::runtime_error("Usage: " + (std::string)argv[0] + " codec <source_path> -n <num_images> -r <repeat>");
+		}
+		std::string mode = argv[1];
+		std::string source = argv[2];
+		int count = 200;
+		int repeat = 3;
+
+		// Parse command-line arguments
+		for (int i = 3; i < argc; ++i)
+		{
+			std::string arg = argv[i];
+			if (arg == "-n" && i + 1 < argc)
+			{
+				count = std::atoi(argv[i + 1]);
+				++i;
+			}
+			else if (arg == "-r" && i + 1 < argc)
+			{
+				repeat = std::max(1, std::atoi(argv[i + 1]));
+				++i;
+			}
+		}
+		if (source.back() != '/')
+		{
+			source += "/";
+		}
+
+		if (mode == "codec")
+		{
+			benchmarkCodecs(loadImages(source, count), repeat);
+		}
+		else
+		{
+			throw std::runtime_error("Unknown benchmark: " + mode);
+		}
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
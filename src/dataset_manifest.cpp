@@ -0,0 +1,446 @@
+#include "dataset_manifest.h"
+#include "image_codec.h"
+#include "image_pack.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+const std::string DatasetManifest::Extension = ".LFM";
+
+std::mutex DatasetManifest::mutex;
+std::string DatasetManifest::root;
+std::vector<DatasetManifest::Directory> DatasetManifest::directories;
+std::vector<std::string> DatasetManifest::variants;
+bool DatasetManifest::changed = false;
+bool DatasetManifest::readOnly = false;
+
+namespace
+{
+	std::string Normalize(const std::string &path)
+	{
+		std::string normal = std::filesystem::absolute(path).lexically_normal().generic_string();
+		while (normal.size() > 1 && normal.back() == '/')
+		{
+			normal.pop_back();
+		}
+		return normal;
+	}
+
+	int32_t ParseNumber(const std::string &name)
+	{
+		// "image (12).JPG" -> 12
+		const size_t open = name.find('(');
+		int32_t number = 0;
+		if (open != std::string::npos)
+		{
+			std::from_chars(name.data() + open + 1, name.data() + name.size(), number);
+		}
+		return number;
+	}
+}
+
+void DatasetManifest::Open(const std::string &root, bool readOnly)
+{
+	DatasetManifest::Close();
+	std::lock_guard<std::mutex> lock(DatasetManifest::mutex);
+	DatasetManifest::root = Normalize(root);
+	DatasetManifest::readOnly = readOnly;
+	if (!DatasetManifest::Load())
+	{
+		DatasetManifest::directories = {{"", -1, {}}};
+		DatasetManifest::variants = {""};
+		DatasetManifest::changed = true;
+	}
+	// One stat per known directory, rescans only what changed since the last run
+	for (size_t directory = 0; directory < DatasetManifest::directories.size();)
+	{
+		directory += DatasetManifest::Refresh(directory);
+	}
+	if (DatasetManifest::changed && !DatasetManifest::readOnly)
+	{
+		DatasetManifest::Save();
+	}
+}
+
+void DatasetManifest::Close()
+{
+	std::lock_guard<std::mutex> lock(DatasetManifest::mutex);
+	if (DatasetManifest::changed && !DatasetManifest::root.empty() && !DatasetManifest::readOnly)
+	{
+		DatasetManifest::Save();
+	}
+	DatasetManifest::root.clear();
+	DatasetManifest::readOnly = false;
+	DatasetManifest::directories.clear();
+	DatasetManifest::variants.clear();
+	DatasetManifest::changed = false;
+}
+
+std::vector<std::string> DatasetManifest::Directories()
+{
+	std::lock_guard<std::mutex> lock(DatasetManifest::mutex);
+	std::vector<std::string> paths;
+	for (const auto &directory : DatasetManifest::directories)
+	{
+		paths.push_back(directory.path);
+	}
+	std::sort(paths.begin(), paths.end());
+	return paths;
+}
+
+std::vector<DatasetManifest::Record> DatasetManifest::GetRecords(const std::string &directoryPath)
+{
+	std::lock_guard<std::mutex> lock(DatasetManifest::mutex);
+	int32_t directory = DatasetManifest::FindDirectory(directoryPath);
+	std::string path;
+	if (directory < 0 && DatasetManifest::RelativePath(directoryPath, path) && DatasetManifest::DirectoryTime(directoryPath) != -1)
+	{
+		// Created under the root since the last scan
+		DatasetManifest::directories.push_back({path, -1, {}});
+		directory = DatasetManifest::directories.size() - 1;
+	}
+	if (directory < 0)
+	{
+		// Outside of the manifest, scanned for this call only
+		return DatasetManifest::Scan(directoryPath, nullptr);
+	}
+	if (!DatasetManifest::Refresh(directory))
+	{
+		return {};
+	}
+	return DatasetManifest::directories[directory].records;
+}
+
+std::string DatasetManifest::Variant(int32_t variantId)
+{
+	std::lock_guard<std::mutex> lock(DatasetManifest::mutex);
+	return DatasetManifest::variants[variantId];
+}
+
+void DatasetManifest::Invalidate(const std::string &directoryPath)
+{
+	// Writes within the mtime resolution would otherwise go unnoticed
+	std::lock_guard<std::mutex> lock(DatasetManifest::mutex);
+	const int32_t directory = DatasetManifest::FindDirectory(directoryPath);
+	if (directory >= 0)
+	{
+		DatasetManifest::directories[directory].mtime = -1;
+	}
+}
+
+bool DatasetManifest::Load()
+{
+	// Single open, single read
+	const std::string filePath = DatasetManifest::root + DatasetManifest::Extension;
+	std::ifstream file(filePath, std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	const size_t size = file.tellg();
+	std::vector<char> buffer(size);
+	file.seekg(0);
+	if (size < sizeof(Header) || !file.read(buffer.data(), size))
+	{
+		return false;
+	}
+	Header header;
+	std::memcpy(&header, buffer.data(), sizeof(Header));
+	if (std::string(header.magic, 4) != "LFMF" || header.version != 1 || header.variantCount == 0)
+	{
+		return false;
+	}
+	// Counts are checked one table at a time so the offsets cannot overflow
+	size_t remaining = size - sizeof(Header);
+	if (header.directoryCount > remaining / sizeof(DirectoryEntry))
+	{
+		return false;
+	}
+	remaining -= header.directoryCount * sizeof(DirectoryEntry);
+	if (header.variantCount > remaining / sizeof(VariantEntry))
+	{
+		return false;
+	}
+	remaining -= header.variantCount * sizeof(VariantEntry);
+	if (header.recordCount > remaining / sizeof(RecordEntry))
+	{
+		return false;
+	}
+	remaining -= header.recordCount * sizeof(RecordEntry);
+	if (header.stringsSize != remaining)
+	{
+		return false;
+	}
+	const size_t directoriesOffset = sizeof(Header);
+	const size_t variantsOffset = directoriesOffset + header.directoryCount * sizeof(DirectoryEntry);
+	const size_t recordsOffset = variantsOffset + header.variantCount * sizeof(VariantEntry);
+	const size_t stringsOffset = recordsOffset + header.recordCount * sizeof(RecordEntry);
+	const DirectoryEntry *directoryEntries = reinterpret_cast<const DirectoryEntry *>(buffer.data() + directoriesOffset);
+	const VariantEntry *variantEntries = reinterpret_cast<const VariantEntry *>(buffer.data() + variantsOffset);
+	const RecordEntry *recordEntries = reinterpret_cast<const RecordEntry *>(buffer.data() + recordsOffset);
+	const char *strings = buffer.data() + stringsOffset;
+	// Every name must lie inside the strings block
+	auto inside = [&](uint64_t offset, uint64_t length)
+	{
+		return offset <= header.stringsSize && length <= header.stringsSize - offset;
+	};
+
+	std::vector<std::string> loadedVariants;
+	for (uint32_t i = 0; i < header.variantCount; i++)
+	{
+		if (!inside(variantEntries[i].nameOffset, variantEntries[i].nameLength))
+		{
+			return false;
+		}
+		loadedVariants.emplace_back(strings + variantEntries[i].nameOffset, variantEntries[i].nameLength);
+	}
+	std::vector<Directory> loadedDirectories;
+	uint64_t record = 0;
+	for (uint32_t i = 0; i < header.directoryCount; i++)
+	{
+		if (!inside(directoryEntries[i].pathOffset, directoryEntries[i].pathLength))
+		{
+			return false;
+		}
+		Directory directory = {std::string(strings + directoryEntries[i].pathOffset, directoryEntries[i].pathLength), directoryEntries[i].mtime, {}};
+		for (uint32_t j = 0; j < directoryEntries[i].recordCount && record < header.recordCount; j++, record++)
+		{
+			const RecordEntry &entry = recordEntries[record];
+			if (!inside(entry.nameOffset, entry.nameLength))
+			{
+				return false;
+			}
+			directory.records.push_back({std::string(strings + entry.nameOffset, entry.nameLength), static_cast<int32_t>(i), entry.groupId, entry.variantId, entry.number, entry.size, entry.mtime});
+		}
+		loadedDirectories.push_back(std::move(directory));
+	}
+	DatasetManifest::variants.swap(loadedVariants);
+	DatasetManifest::directories.swap(loadedDirectories);
+	return !DatasetManifest::directories.empty();
+}
+
+void DatasetManifest::Save()
+{
+	// Directory times too close to now may hide a later write in the same tick
+	const int64_t recent = (std::filesystem::file_time_type::clock::now() - std::chrono::seconds(2)).time_since_epoch().count();
+
+	std::string strings;
+	std::vector<DirectoryEntry> directoryEntries;
+	std::vector<VariantEntry> variantEntries;
+	std::vector<RecordEntry> recordEntries;
+	for (const auto &directory : DatasetManifest::directories)
+	{
+		directoryEntries.push_back({strings.size(), static_cast<uint32_t>(directory.path.size()), static_cast<uint32_t>(directory.records.size()), directory.mtime > recent ? -1 : directory.mtime});
+		strings += directory.path;
+		for (const auto &record : directory.records)
+		{
+			recordEntries.push_back({strings.size(), static_cast<uint32_t>(record.name.size()), record.classId, record.groupId, record.variantId, record.number, 0, record.size, record.mtime});
+			strings += record.name;
+		}
+	}
+	for (const auto &variant : DatasetManifest::variants)
+	{
+		variantEntries.push_back({strings.size(), static_cast<uint32_t>(variant.size()), 0});
+		strings += variant;
+	}
+	Header header = {{'L', 'F', 'M', 'F'}, 1, static_cast<uint32_t>(directoryEntries.size()), static_cast<uint32_t>(variantEntries.size()), recordEntries.size(), strings.size()};
+
+	// Processes sharing a root (train shards) each write their own temporary file,
+	// the lock keeps one write and rename at a time
+	const std::string filePath = DatasetManifest::root + DatasetManifest::Extension;
+	const std::string temporaryPath = filePath + "." + std::to_string(::getpid()) + ".tmp";
+	const std::string lockPath = filePath + ".lock";
+	const int lock = ::open(lockPath.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+	if (lock < 0 || ::flock(lock, LOCK_EX) != 0)
+	{
+		if (lock >= 0)
+		{
+			::close(lock);
+		}
+		throw std::runtime_error("Unable to lock " + lockPath);
+	}
+	bool written;
+	{
+		std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+		written = file.is_open() &&
+				  file.write(reinterpret_cast<const char *>(&header), sizeof(Header)) &&
+				  file.write(reinterpret_cast<const char *>(directoryEntries.data()), directoryEntries.size() * sizeof(DirectoryEntry)) &&
+				  file.write(reinterpret_cast<const char *>(variantEntries.data()), variantEntries.size() * sizeof(VariantEntry)) &&
+				  file.write(reinterpret_cast<const char *>(recordEntries.data()), recordEntries.size() * sizeof(RecordEntry)) &&
+				  file.write(strings.data(), strings.size());
+		file.close();
+		written = written && !file.fail();
+	}
+	std::error_code error;
+	if (written)
+	{
+		std::filesystem::rename(temporaryPath, filePath, error);
+	}
+	else
+	{
+		std::filesystem::remove(temporaryPath, error);
+	}
+	::close(lock);
+	if (!written || error)
+	{
+		throw std::runtime_error("Unable to write " + temporaryPath);
+	}
+	DatasetManifest::changed = false;
+}
+
+bool DatasetManifest::Refresh(size_t directory)
+{
+	const std::string directoryPath = DatasetManifest::root + "/" + DatasetManifest::directories[directory].path;
+	const int64_t mtime = DatasetManifest::DirectoryTime(directoryPath);
+	if (mtime == DatasetManifest::directories[directory].mtime && mtime != -1)
+	{
+		return true;
+	}
+	if (mtime == -1 && directory > 0)
+	{
+		// Removed, later directories move down one class id
+		DatasetManifest::directories.erase(DatasetManifest::directories.begin() + directory);
+		for (size_t next = directory; next < DatasetManifest::directories.size(); next++)
+		{
+			for (auto &record : DatasetManifest::directories[next].records)
+			{
+				record.classId = next;
+			}
+		}
+		DatasetManifest::changed = true;
+		return false;
+	}
+	std::vector<std::string> subdirectories;
+	std::vector<Record> records = DatasetManifest::Scan(directoryPath, &subdirectories);
+	for (auto &record : records)
+	{
+		record.classId = directory;
+	}
+	DatasetManifest::directories[directory].records = std::move(records);
+	DatasetManifest::directories[directory].mtime = mtime;
+	DatasetManifest::changed = true;
+
+	// New directories are scanned on the spot
+	for (const auto &subdirectory : subdirectories)
+	{
+		const std::string path = DatasetManifest::directories[directory].path.empty() ? subdirectory : DatasetManifest::directories[directory].path + "/" + subdirectory;
+		if (DatasetManifest::FindDirectory(DatasetManifest::root + "/" + path) < 0)
+		{
+			DatasetManifest::directories.push_back({path, -1, {}});
+			DatasetManifest::Refresh(DatasetManifest::directories.size() - 1);
+		}
+	}
+	return true;
+}
+
+std::vector<DatasetManifest::Record> DatasetManifest::Scan(const std::string &directoryPath, std::vector<std::string> *subdirectories)
+{
+	std::vector<Record> records;
+	std::error_code error;
+	for (const auto &entry : std::filesystem::directory_iterator(directoryPath, error))
+	{
+		const std::string name = entry.path().filename().generic_string();
+		// Links are skipped, a directory is only indexed under its real path
+		if (entry.is_symlink())
+		{
+			continue;
+		}
+		if (entry.is_directory())
+		{
+			if (subdirectories != nullptr)
+			{
+				subdirectories->push_back(name);
+			}
+			continue;
+		}
+		const std::string extension = entry.path().extension().string();
+		if (!entry.is_regular_file() || !(ImageCodec::IsImageExtension(extension) || extension == ImagePack::Extension))
+		{
+			continue;
+		}
+		std::error_code statError;
+		const int64_t size = entry.file_size(statError);
+		const int64_t mtime = entry.last_write_time(statError).time_since_epoch().count();
+		records.push_back({name, -1, -1, 0, ParseNumber(name), size, mtime});
+	}
+
+	// Sample number first, so an image precedes its transformations
+	std::sort(records.begin(), records.end(), [](const Record &a, const Record &b)
+			  { return a.number != b.number ? a.number < b.number : a.name < b.name; });
+
+	// "image (1)_T3.JPG" belongs to the group of "image (1).JPG", variant T3
+	std::unordered_map<std::string, int32_t> groups;
+	for (auto &record : records)
+	{
+		const std::string stem = record.name.substr(0, record.name.find_last_of('.'));
+		const size_t position = stem.find_last_of('_');
+		std::string group = stem;
+		if (position != std::string::npos && stem[position + 1] == 'T' &&
+			std::all_of(stem.begin() + position + 2, stem.end(), [](char c)
+						{ return std::isdigit(static_cast<unsigned char>(c)); }))
+		{
+			group = stem.substr(0, position);
+			record.variantId = DatasetManifest::VariantId(stem.substr(position + 1));
+		}
+		record.groupId = groups.emplace(group, groups.size()).first->second;
+	}
+	return records;
+}
+
+bool DatasetManifest::RelativePath(const std::string &directoryPath, std::string &path)
+{
+	if (DatasetManifest::root.empty())
+	{
+		return false;
+	}
+	const std::string relative = std::filesystem::path(Normalize(directoryPath)).lexically_relative(DatasetManifest::root).generic_string();
+	if (relative.empty() || relative.starts_with(".."))
+	{
+		return false;
+	}
+	path = relative == "." ? "" : relative;
+	return true;
+}
+
+int32_t DatasetManifest::FindDirectory(const std::string &directoryPath)
+{
+	std::string path;
+	if (!DatasetManifest::RelativePath(directoryPath, path))
+	{
+		return -1;
+	}
+	for (size_t directory = 0; directory < DatasetManifest::directories.size(); directory++)
+	{
+		if (DatasetManifest::directories[directory].path == path)
+		{
+			return directory;
+		}
+	}
+	return -1;
+}
+
+int32_t DatasetManifest::VariantId(const std::string &variant)
+{
+	const auto found = std::find(DatasetManifest::variants.begin(), DatasetManifest::variants.end(), variant);
+	if (found != DatasetManifest::variants.end())
+	{
+		return found - DatasetManifest::variants.begin();
+	}
+	DatasetManifest::variants.push_back(variant);
+	return DatasetManifest::variants.size() - 1;
+}
+
+int64_t DatasetManifest::DirectoryTime(const std::string &directoryPath)
+{
+	std::error_code error;
+	const auto time = std::filesystem::last_write_time(directoryPath, error);
+	return error ? -1 : time.time_since_epoch().count();
+}
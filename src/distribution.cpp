@@ -1,45 +1,46 @@
-﻿#include <iostream>
+﻿#include "dataset_manifest.h"
+
+#include <iostream>
 #include <filesystem>
 #include <sstream>
+#include <vector>
 
-std::string checkImagesInDirectory(const std::string &directoryPath, std::string informations = "", size_t deepness = 0)
+std::string checkImagesInDirectory(const std::string &rootPath, const std::vector<std::string> &directories, const std::string &directoryPath = "", std::string informations = "", size_t deepness = 0)
 {
-	size_t imageCount = 0;
-	for (const auto &entry : std::filesystem::directory_iterator(directoryPath))
+	for (const auto &directory : directories)
 	{
-		std::filesystem::path entryPath = entry.path();
-		std::string DirectoryName = entryPath.filename().generic_string();
-		if (std::filesystem::is_directory(entryPath))
+		// Direct subdirectories only, hidden ones hold generated images
+		if (directory.empty() || std::filesystem::path(directory).parent_path().generic_string() != directoryPath || std::filesystem::path(directory).filename().string().starts_with("."))
+		{
+			continue;
+		}
+		for (size_t i = 0; i <= deepness; i++)
 		{
-			for (size_t i = 0; i <= deepness; i++)
+			if (i == deepness)
 			{
-				if (i == deepness)
-				{
-					std::cout << "|--- ";
-				}
-				else
-				{
-					std::cout << "|    ";
-				}
+				std::cout << "|--- ";
+			}
+			else
+			{
+				std::cout << "|    ";
 			}
-			std::string genericPath = entryPath.generic_string();
-			std::string directoryName = entryPath.filename().generic_string();
-			std::cout << directoryName << std::endl;
-			informations += directoryName + ",";
-			informations = checkImagesInDirectory(genericPath, informations, deepness + 1);
-			informations += ",";
 		}
-		else if (std::filesystem::is_regular_file(entryPath))
+		std::string directoryName = std::filesystem::path(directory).filename().generic_string();
+		std::cout << directoryName << std::endl;
+		informations += directoryName + ",";
+		informations = checkImagesInDirectory(rootPath, directories, directory, informations, deepness + 1);
+		informations += ",";
+	}
+	size_t imageCount = 0;
+	for (const auto &record : DatasetManifest::GetRecords(rootPath + "/" + directoryPath))
+	{
+		size_t pos = record.name.find('.');
+		if (pos != std::string::npos)
 		{
-			std::string fileName = entryPath.filename().generic_string();
-			size_t pos = fileName.find('.');
-			if (pos != std::string::npos)
+			std::string fileType = record.name.substr(pos, record.name.size());
+			if (fileType == ".JPG")
 			{
-				std::string fileType = fileName.substr(pos, fileName.size());
-				if (fileType == ".JPG")
-				{
-					imageCount++;
-				}
+				imageCount++;
 			}
 		}
 	}
@@ -135,7 +136,10 @@ int main(int argc, char *argv[])
 		std::string directoryPath = argv[1];
 		std::cout << directoryPath << std::endl;
 
-		std::string output_str = directoryPath + "," + checkImagesInDirectory(directoryPath);
+		// Directory tree and image counts come from the dataset manifest, read-only: the report writes nothing next to the dataset
+		DatasetManifest::Open(directoryPath, true);
+		std::string output_str = directoryPath + "," + checkImagesInDirectory(directoryPath, DatasetManifest::Directories());
+		DatasetManifest::Close();
 		std::vector<std::pair<std::string, std::string>> output_pair = extractKeyValuePairsFromString(output_str);
 		output_pair.erase(output_pair.begin());
 
@@ -0,0 +1,275 @@
+#include "feature_cache.h"
+#include "image_processing.h"
+#include "image_dependencies.h"
+#include "image_utils.h"
+#include "image_store.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::mutex FeatureCache::mutex;
+std::string FeatureCache::path;
+uchar *FeatureCache::mapping = nullptr;
+size_t FeatureCache::mappingSize = 0;
+size_t FeatureCache::validSize = 0;
+std::unordered_map<uint64_t, std::pair<const double *, uint32_t>> FeatureCache::index;
+std::unordered_map<uint64_t, std::vector<double>> FeatureCache::pending;
+
+void FeatureCache::Open(const std::string &cachePath)
+{
+	FeatureCache::Close();
+	std::lock_guard<std::mutex> lock(FeatureCache::mutex);
+	FeatureCache::path = cachePath;
+	const int fd = ::open(cachePath.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0)
+	{
+		// Created on the first Close
+		return;
+	}
+	if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header))
+	{
+		::close(fd);
+		return;
+	}
+	void *address = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (address == MAP_FAILED)
+	{
+		throw std::runtime_error("Unable to map " + cachePath);
+	}
+	FeatureCache::mapping = static_cast<uchar *>(address);
+	FeatureCache::mappingSize = st.st_size;
+	const Header *header = reinterpret_cast<const Header *>(FeatureCache::mapping);
+	if (std::string(header->magic, 4) != "LFFC" || header->version != 1)
+	{
+		// Unknown layout, rewritten on Close
+		return;
+	}
+
+	// Rows are indexed up to the first incomplete one, a crash only loses its tail
+	size_t offset = sizeof(Header);
+	while (offset + sizeof(Row) <= FeatureCache::mappingSize)
+	{
+		const Row *row = reinterpret_cast<const Row *>(FeatureCache::mapping + offset);
+		const size_t end = offset + sizeof(Row) + row->count * sizeof(double);
+		if (end > FeatureCache::mappingSize)
+		{
+			break;
+		}
+		FeatureCache::index[row->key] = {reinterpret_cast<const double *>(row + 1), row->count};
+		offset = end;
+	}
+	FeatureCache::validSize = offset;
+}
+
+size_t FeatureCache::CompleteSize(int fd, size_t fileSize)
+{
+	// Rows before validSize were complete at Open and are never rewritten, the rest of the file is read again
+	size_t offset = FeatureCache::validSize <= fileSize ? FeatureCache::validSize : 0;
+	std::vector<char> tail(fileSize - offset);
+	if (::pread(fd, tail.data(), tail.size(), offset) != static_cast<ssize_t>(tail.size()))
+	{
+		return offset;
+	}
+	size_t position = 0;
+	if (offset == 0)
+	{
+		const Header *header = reinterpret_cast<const Header *>(tail.data());
+		if (tail.size() < sizeof(Header) || std::string(header->magic, 4) != "LFFC" || header->version != 1)
+		{
+			// Unknown layout, rewritten from the start
+			return 0;
+		}
+		position = sizeof(Header);
+	}
+	while (position + sizeof(Row) <= tail.size())
+	{
+		Row row;
+		std::memcpy(&row, tail.data() + position, sizeof(Row));
+		const size_t end = position + sizeof(Row) + row.count * sizeof(double);
+		if (end > tail.size())
+		{
+			break;
+		}
+		position = end;
+	}
+	return offset + position;
+}
+
+void FeatureCache::Close()
+{
+	std::lock_guard<std::mutex> lock(FeatureCache::mutex);
+	if (!FeatureCache::pending.empty())
+	{
+		// Other processes (shards) may share the file, appends are serialized by a lock
+		const int fd = ::open(FeatureCache::path.c_str(), O_CREAT | O_RDWR, 0644);
+		struct stat st;
+		const bool locked = fd >= 0 && ::flock(fd, LOCK_EX) == 0 && ::fstat(fd, &st) == 0;
+		// New rows are appended after the last complete row, including those another process added since Open.
+		// A process that crashed mid-append leaves a torn row, which is cut off here
+		const size_t offset = locked ? FeatureCache::CompleteSize(fd, st.st_size) : 0;
+		std::vector<char> buffer;
+		if (offset == 0)
+		{
+			Header header = {{'L', 'F', 'F', 'C'}, 1, 0};
+			buffer.insert(buffer.end(), reinterpret_cast<const char *>(&header), reinterpret_cast<const char *>(&header + 1));
+		}
+		for (const auto &[key, features] : FeatureCache::pending)
+		{
+			Row row = {key, static_cast<uint32_t>(features.size()), 0};
+			buffer.insert(buffer.end(), reinterpret_cast<const char *>(&row), reinterpret_cast<const char *>(&row + 1));
+			buffer.insert(buffer.end(), reinterpret_cast<const char *>(features.data()), reinterpret_cast<const char *>(features.data() + features.size()));
+		}
+		const bool written = locked &&
+							 ::ftruncate(fd, offset) == 0 &&
+							 ::pwrite(fd, buffer.data(), buffer.size(), offset) == static_cast<ssize_t>(buffer.size());
+		if (fd >= 0)
+		{
+			::close(fd);
+		}
+		if (!written)
+		{
+			std::cerr << "Unable to write " << FeatureCache::path << std::endl;
+		}
+	}
+	if (FeatureCache::mapping != nullptr)
+	{
+		::munmap(FeatureCache::mapping, FeatureCache::mappingSize);
+	}
+	FeatureCache::path.clear();
+	FeatureCache::mapping = nullptr;
+	FeatureCache::mappingSize = 0;
+	FeatureCache::validSize = 0;
+	FeatureCache::index.clear();
+	FeatureCache::pending.clear();
+}
+
+uint64_t FeatureCache::Key(uint64_t contentHash, size_t view)
+{
+	// Extractor settings, the keypoint count only matters for the ORB view
+	const bool keyPoints = ImageProcessing::keyPointFeatures && view == ImageProcessing::ORBView;
+	const int64_t settings[] = {FeatureCache::Version, static_cast<int64_t>(view), keyPoints, keyPoints ? ImageProcessing::orbFeatures : 0};
+	return ImageDependencies::Hash(settings, sizeof(settings), contentHash);
+}
+
+bool FeatureCache::Get(uint64_t key, std::vector<double> &features)
+{
+	std::lock_guard<std::mutex> lock(FeatureCache::mutex);
+	const auto stored = FeatureCache::index.find(key);
+	if (stored != FeatureCache::index.end())
+	{
+		features.assign(stored->second.first, stored->second.first + stored->second.second);
+		return true;
+	}
+	const auto added = FeatureCache::pending.find(key);
+	if (added != FeatureCache::pending.end())
+	{
+		features = added->second;
+		return true;
+	}
+	return false;
+}
+
+void FeatureCache::Put(uint64_t key, const std::vector<double> &features)
+{
+	std::lock_guard<std::mutex> lock(FeatureCache::mutex);
+	if (FeatureCache::path.empty() || FeatureCache::index.count(key))
+	{
+		return;
+	}
+	FeatureCache::pending[key] = features;
+}
+
+std::vector<double> FeatureCache::Extract(uint64_t contentHash, size_t view, const std::function<cv::Mat()> &load)
+{
+	const uint64_t key = FeatureCache::Key(contentHash, view);
+	std::vector<double> features;
+	if (FeatureCache::Get(key, features))
+	{
+		return features;
+	}
+	features = ImageProcessing::ExtractCaracteristics(load(), view);
+	FeatureCache::Put(key, features);
+	return features;
+}
+
+std::vector<double> FeatureCache::Extract(const std::string &filePath, size_t view)
+{
+	return FeatureCache::Extract(ImageDependencies::HashFile(filePath), view, [&]()
+								 {
+		cv::Mat image = ImageUtils::ReadImage(filePath, cv::IMREAD_COLOR);
+		if (image.empty()) {
+			throw std::runtime_error("Unable to load the image: " + filePath);
+		}
+		return image; });
+}
+
+std::vector<double> FeatureCache::Extract(const std::string &filePath, const std::vector<uchar> &data, size_t view)
+{
+	// File already in memory, hashed and decoded without touching the disk again
+	return FeatureCache::Extract(ImageDependencies::Hash(data.data(), data.size()), view, [&]()
+								 {
+		// Features are computed on BGR images, read the same way from the store or the file
+		cv::Mat image = ImageStore::Get(filePath, cv::IMREAD_COLOR);
+		if (image.empty()) {
+			image = ImageCodec::Decode(data.data(), data.size(), cv::IMREAD_COLOR);
+		}
+		if (image.empty()) {
+			throw std::runtime_error("Unable to decode the image: " + filePath);
+		}
+		return image; });
+}
+
+uint64_t FeatureCache::LeafMaskKey(uint64_t contentHash)
+{
+	// Segmentation settings, a view index no image group uses
+	const int64_t settings[] = {FeatureCache::Version, -1, static_cast<int64_t>(ImageProcessing::segmentation), ImageProcessing::segmentationScale};
+	return ImageDependencies::Hash(settings, sizeof(settings), contentHash);
+}
+
+bool FeatureCache::GetLeafMask(uint64_t contentHash, cv::Size &size, cv::Rect &box, cv::Mat &mask)
+{
+	// Image size and leaf bounding box, then the run lengths of the mask inside the box
+	std::vector<double> row;
+	if (!FeatureCache::Get(FeatureCache::LeafMaskKey(contentHash), row) || row.size() < 6)
+	{
+		return false;
+	}
+	size = cv::Size(row[1], row[0]);
+	box = cv::Rect(row[2], row[3], row[4], row[5]);
+	mask = cv::Mat::zeros(box.height, box.width, CV_8UC1);
+	uchar *pixel = mask.ptr<uchar>(0);
+	uchar *const end = pixel + mask.total();
+	uchar value = 0;
+	for (size_t run = 6; run < row.size() && pixel + static_cast<size_t>(row[run]) <= end; run++)
+	{
+		std::fill(pixel, pixel + static_cast<size_t>(row[run]), value);
+		pixel += static_cast<size_t>(row[run]);
+		value = 255 - value;
+	}
+	return pixel == end;
+}
+
+void FeatureCache::PutLeafMask(uint64_t contentHash, cv::Size size, const cv::Rect &box, const cv::Mat &mask)
+{
+	std::vector<double> row = {static_cast<double>(size.height), static_cast<double>(size.width), static_cast<double>(box.x), static_cast<double>(box.y), static_cast<double>(box.width), static_cast<double>(box.height)};
+	const cv::Mat continuous = mask.isContinuous() ? mask : mask.clone();
+	const uchar *pixel = continuous.ptr<uchar>(0);
+	const uchar *const end = pixel + continuous.total();
+	// Runs alternate between background and leaf, starting with background
+	bool leaf = false;
+	while (pixel < end)
+	{
+		const uchar *next = std::find_if(pixel, end, [&](uchar value)
+										 { return (value != 0) != leaf; });
+		row.push_back(next - pixel);
+		pixel = next;
+		leaf = !leaf;
+	}
+	FeatureCache::Put(FeatureCache::LeafMaskKey(contentHash), row);
+}
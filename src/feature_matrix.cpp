@@ -0,0 +1,98 @@
+#include "feature_matrix.h"
+
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+namespace
+{
+	size_t PaddedStride(size_t cols)
+	{
+		const size_t perLine = FeatureMatrix::Alignment / sizeof(double);
+		return (cols + perLine - 1) / perLine * perLine;
+	}
+}
+
+FeatureMatrix::FeatureMatrix(size_t rows, size_t cols)
+{
+	this->Resize(rows, cols);
+}
+
+void FeatureMatrix::Resize(size_t rows, size_t cols)
+{
+	if (cols != this->cols)
+	{
+		if (this->rows > 0)
+		{
+			throw std::runtime_error("Feature count of a filled matrix can not change");
+		}
+		this->cols = cols;
+		this->stride = PaddedStride(cols);
+		this->data.reset();
+		this->capacity = 0;
+	}
+	this->Reserve(rows);
+	// Padding and new rows start as zeros
+	if (rows > this->rows)
+	{
+		std::memset(this->data.get() + this->rows * this->stride, 0, (rows - this->rows) * this->stride * sizeof(double));
+	}
+	this->rows = rows;
+	this->classIds.resize(rows);
+}
+
+void FeatureMatrix::Append(std::span<const double> features, uint8_t classId)
+{
+	if (this->rows == 0 && this->cols != features.size())
+	{
+		this->Resize(0, features.size());
+	}
+	if (features.size() != this->cols)
+	{
+		throw std::runtime_error("Row has " + std::to_string(features.size()) + " features, expected " + std::to_string(this->cols));
+	}
+	if (this->rows == this->capacity)
+	{
+		this->Reserve(std::max<size_t>(64, this->capacity * 2));
+	}
+	double* row = this->data.get() + this->rows * this->stride;
+	std::memcpy(row, features.data(), this->cols * sizeof(double));
+	std::memset(row + this->cols, 0, (this->stride - this->cols) * sizeof(double));
+	this->classIds.push_back(classId);
+	this->rows++;
+}
+
+void FeatureMatrix::Truncate(size_t cols)
+{
+	// Rows keep their stride and place, the dropped columns become padding
+	if (cols >= this->cols)
+	{
+		return;
+	}
+	for (size_t i = 0; i < this->rows; i++)
+	{
+		double* row = this->data.get() + i * this->stride;
+		std::fill(row + cols, row + this->cols, 0.0);
+	}
+	this->cols = cols;
+}
+
+void FeatureMatrix::Reserve(size_t capacity)
+{
+	if (capacity <= this->capacity || this->stride == 0)
+	{
+		return;
+	}
+	double* data = static_cast<double*>(std::aligned_alloc(FeatureMatrix::Alignment, capacity * this->stride * sizeof(double)));
+	if (data == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+	if (this->rows > 0)
+	{
+		std::memcpy(data, this->data.get(), this->rows * this->stride * sizeof(double));
+	}
+	this->data.reset(data);
+	this->capacity = capacity;
+	this->classIds.reserve(capacity);
+}
@@ -0,0 +1,123 @@
+#include "feature_stats.h"
+
+#include <opencv2/opencv.hpp>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+const std::string FeatureStats::Extension = ".LFS";
+
+FeatureStats FeatureStats::Compute(const FeatureMatrix& matrix)
+{
+	// Chunks of rows in parallel, merged in a fixed order
+	const size_t numChunks = std::max<size_t>(1, std::min<size_t>(cv::getNumThreads() * 4, matrix.Rows()));
+	std::vector<FeatureStats> chunks(numChunks);
+	cv::parallel_for_(cv::Range(0, numChunks), [&](const cv::Range& range)
+					  {
+		for (int chunk = range.start; chunk < range.end; chunk++) {
+			for (size_t row = matrix.Rows() * chunk / numChunks; row < matrix.Rows() * (chunk + 1) / numChunks; row++) {
+				chunks[chunk].Add(matrix.Row(row));
+			}
+		} });
+	FeatureStats stats;
+	for (const FeatureStats& chunk : chunks)
+	{
+		stats.Merge(chunk);
+	}
+	return stats;
+}
+
+FeatureStats FeatureStats::Load(const std::string& filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	Header header;
+	if (!file.is_open() || !file.read(reinterpret_cast<char*>(&header), sizeof(Header)) ||
+		std::memcmp(header.magic, "LFST", 4) != 0 || header.version != 1)
+	{
+		throw std::runtime_error("Invalid feature statistics " + filename);
+	}
+	FeatureStats stats;
+	stats.count = header.count;
+	stats.means.resize(header.featureCount);
+	stats.squaredDiffs.resize(header.featureCount);
+	if (!file.read(reinterpret_cast<char*>(stats.means.data()), stats.means.size() * sizeof(double)) ||
+		!file.read(reinterpret_cast<char*>(stats.squaredDiffs.data()), stats.squaredDiffs.size() * sizeof(double)))
+	{
+		throw std::runtime_error("Invalid feature statistics " + filename);
+	}
+	return stats;
+}
+
+void FeatureStats::Save(const std::string& filename) const
+{
+	const Header header = {{'L', 'F', 'S', 'T'}, 1, this->count, this->means.size()};
+	const std::string temporaryPath = filename + ".tmp";
+	{
+		std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open() ||
+			!file.write(reinterpret_cast<const char*>(&header), sizeof(Header)) ||
+			!file.write(reinterpret_cast<const char*>(this->means.data()), this->means.size() * sizeof(double)) ||
+			!file.write(reinterpret_cast<const char*>(this->squaredDiffs.data()), this->squaredDiffs.size() * sizeof(double)))
+		{
+			throw std::runtime_error("Unable to write " + temporaryPath);
+		}
+	}
+	std::filesystem::rename(temporaryPath, filename);
+}
+
+void FeatureStats::Add(std::span<const double> features)
+{
+	if (this->count == 0)
+	{
+		this->means.assign(features.size(), 0.0);
+		this->squaredDiffs.assign(features.size(), 0.0);
+	}
+	if (features.size() != this->means.size())
+	{
+		throw std::runtime_error("Row has " + std::to_string(features.size()) + " features, expected " + std::to_string(this->means.size()));
+	}
+	this->count++;
+	const double weight = 1.0 / this->count;
+	for (size_t i = 0; i < features.size(); i++)
+	{
+		const double delta = features[i] - this->means[i];
+		this->means[i] += delta * weight;
+		this->squaredDiffs[i] += delta * (features[i] - this->means[i]);
+	}
+}
+
+void FeatureStats::Merge(const FeatureStats& other)
+{
+	if (other.count == 0)
+	{
+		return;
+	}
+	if (this->count == 0)
+	{
+		*this = other;
+		return;
+	}
+	if (other.means.size() != this->means.size())
+	{
+		throw std::runtime_error("Feature statistics of " + std::to_string(other.means.size()) + " features, expected " + std::to_string(this->means.size()));
+	}
+	// Pairwise combination of two partial results (Chan et al.)
+	const double count = static_cast<double>(this->count + other.count);
+	const double otherWeight = other.count / count;
+	const double crossWeight = static_cast<double>(this->count) * other.count / count;
+	for (size_t i = 0; i < this->means.size(); i++)
+	{
+		const double delta = other.means[i] - this->means[i];
+		this->means[i] += delta * otherWeight;
+		this->squaredDiffs[i] += other.squaredDiffs[i] + delta * delta * crossWeight;
+	}
+	this->count += other.count;
+}
+
+double FeatureStats::StdDev(size_t col) const
+{
+	// Population deviation, a constant feature gives exactly zero
+	return this->count > 0 ? std::sqrt(this->squaredDiffs[col] / this->count) : 0.0;
+}
@@ -0,0 +1,121 @@
+#include "generation_tree.h"
+
+#include <chrono>
+#include <filesystem>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+const std::string GenerationTree::Directory = ".generated";
+
+std::thread GenerationTree::reclaimer;
+int GenerationTree::lock = -1;
+
+namespace
+{
+	std::filesystem::path GenerationName(std::string generation)
+	{
+		while (generation.size() > 1 && generation.back() == '/')
+		{
+			generation.pop_back();
+		}
+		return std::filesystem::path(generation).filename();
+	}
+}
+
+std::string GenerationTree::Current(const std::string &root)
+{
+	const std::filesystem::path link = std::filesystem::path(root) / GenerationTree::Directory / "current";
+	std::error_code error;
+	const std::filesystem::path target = std::filesystem::read_symlink(link, error);
+	if (error)
+	{
+		return "";
+	}
+	// Resolved once, a later swap does not move a run to another generation
+	return (link.parent_path() / target).generic_string() + "/";
+}
+
+std::string GenerationTree::Create(const std::string &root)
+{
+	// Named after its creation time, not visible until published
+	const std::filesystem::path generation = std::filesystem::path(root) / GenerationTree::Directory / std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+	std::filesystem::create_directories(generation.parent_path());
+	// Locked before the directory exists, so a reclaimer never sees it unlocked while in progress
+	const std::string lockPath = generation.generic_string() + ".lock";
+	GenerationTree::lock = ::open(lockPath.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+	if (GenerationTree::lock < 0 || ::flock(GenerationTree::lock, LOCK_EX) != 0)
+	{
+		throw std::runtime_error("Unable to lock " + lockPath);
+	}
+	std::filesystem::create_directories(generation);
+	return generation.generic_string() + "/";
+}
+
+void GenerationTree::Publish(const std::string &root, const std::string &generation)
+{
+	// rename() replaces the previous link in a single step
+	const std::filesystem::path link = std::filesystem::path(root) / GenerationTree::Directory / "current";
+	const std::filesystem::path temporary = link.generic_string() + ".tmp";
+	std::error_code error;
+	std::filesystem::remove(temporary, error);
+	std::filesystem::create_directory_symlink(GenerationName(generation), temporary);
+	std::filesystem::rename(temporary, link);
+	// Published, the generation is now protected by the link
+	if (GenerationTree::lock >= 0)
+	{
+		std::filesystem::remove(std::filesystem::path(root) / GenerationTree::Directory / (GenerationName(generation).string() + ".lock"), error);
+		::close(GenerationTree::lock);
+		GenerationTree::lock = -1;
+	}
+}
+
+void GenerationTree::Reclaim(const std::string &root)
+{
+	GenerationTree::Wait();
+	const std::filesystem::path current = GenerationName(GenerationTree::Current(root));
+	if (current.empty())
+	{
+		return;
+	}
+	std::vector<std::filesystem::path> generations;
+	std::error_code error;
+	std::vector<int> locks;
+	for (const auto &entry : std::filesystem::directory_iterator(std::filesystem::path(root) / GenerationTree::Directory, error))
+	{
+		if (entry.is_symlink() || !entry.is_directory() || entry.path().filename() == current)
+		{
+			continue;
+		}
+		// A lock still held belongs to a run building that generation, one left by a failed run is free
+		const std::string lockPath = entry.path().generic_string() + ".lock";
+		const int fd = ::open(lockPath.c_str(), O_RDWR | O_CLOEXEC);
+		if (fd >= 0 && ::flock(fd, LOCK_EX | LOCK_NB) != 0)
+		{
+			::close(fd);
+			continue;
+		}
+		generations.push_back(entry.path());
+		locks.push_back(fd);
+	}
+	// Replaced and abandoned generations, off the critical path
+	GenerationTree::reclaimer = std::thread([generations, locks]()
+											{
+		for (size_t i = 0; i < generations.size(); i++) {
+			std::error_code error;
+			std::filesystem::remove_all(generations[i], error);
+			if (locks[i] >= 0) {
+				std::filesystem::remove(generations[i].generic_string() + ".lock", error);
+				::close(locks[i]);
+			}
+		} });
+}
+
+void GenerationTree::Wait()
+{
+	if (GenerationTree::reclaimer.joinable())
+	{
+		GenerationTree::reclaimer.join();
+	}
+}
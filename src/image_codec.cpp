@@ -0,0 +1,521 @@
+#include "image_codec.h"
+
+#include <filesystem>
+#include <fstream>
+#include <climits>
+#include <cstring>
+#ifdef HAVE_LIBJPEG
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+#endif
+
+namespace
+{
+#if defined(HAVE_LIBJPEG) && defined(LIBJPEG_TURBO_VERSION_NUMBER) && LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+	struct JpegError
+	{
+		jpeg_error_mgr manager;
+		jmp_buf jump;
+	};
+
+	void JpegErrorExit(j_common_ptr info)
+	{
+		longjmp(reinterpret_cast<JpegError *>(info->err)->jump, 1);
+	}
+
+	// Orientation tag of the Exif segment, 1 when absent
+	int ExifOrientation(const jpeg_decompress_struct &info)
+	{
+		for (jpeg_saved_marker_ptr marker = info.marker_list; marker != nullptr; marker = marker->next)
+		{
+			if (marker->marker != JPEG_APP0 + 1 || marker->data_length < 14 || std::memcmp(marker->data, "Exif\0\0", 6) != 0)
+			{
+				continue;
+			}
+			const uchar *tiff = marker->data + 6;
+			const size_t length = marker->data_length - 6;
+			const bool little = tiff[0] == 'I';
+			auto read16 = [&](size_t offset)
+			{ return little ? tiff[offset] | tiff[offset + 1] << 8 : tiff[offset] << 8 | tiff[offset + 1]; };
+			auto read32 = [&](size_t offset)
+			{ return static_cast<size_t>(read16(little ? offset + 2 : offset)) << 16 | read16(little ? offset : offset + 2); };
+			const size_t directory = read32(4);
+			if (directory + 2 > length)
+			{
+				return 1;
+			}
+			const size_t count = read16(directory);
+			for (size_t i = 0; i < count && directory + 2 + 12 * (i + 1) <= length; i++)
+			{
+				const size_t entry = directory + 2 + 12 * i;
+				if (read16(entry) == 0x0112)
+				{
+					return read16(entry + 8);
+				}
+			}
+		}
+		return 1;
+	}
+#endif
+}
+
+const std::vector<ImageCodec::Format> ImageCodec::formats = {Format::Jpeg, Format::Png, Format::Raw, Format::Qoi};
+
+ImageCodec::Format ImageCodec::ParseFormat(const std::string &name)
+{
+	for (const Format format : ImageCodec::formats)
+	{
+		if (ImageCodec::Name(format) == name)
+		{
+			return format;
+		}
+	}
+	throw std::runtime_error("Unknown image format: " + name + " (jpg, png, raw, qoi)");
+}
+
+std::string ImageCodec::Name(Format format)
+{
+	switch (format)
+	{
+	case Format::Png:
+		return "png";
+	case Format::Raw:
+		return "raw";
+	case Format::Qoi:
+		return "qoi";
+	default:
+		return "jpg";
+	}
+}
+
+std::string ImageCodec::Extension(Format format)
+{
+	switch (format)
+	{
+	case Format::Png:
+		return ".PNG";
+	case Format::Raw:
+		return ".RAW";
+	case Format::Qoi:
+		return ".QOI";
+	default:
+		return ".JPG";
+	}
+}
+
+bool ImageCodec::IsImageExtension(const std::string &extension)
+{
+	for (const Format format : ImageCodec::formats)
+	{
+		if (ImageCodec::Extension(format) == extension)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<uchar> ImageCodec::Encode(const cv::Mat &image, Format format, int jpegQuality)
+{
+	std::vector<uchar> buffer;
+	switch (format)
+	{
+	case Format::Png:
+		// Fastest deflate level, intermediates are short-lived
+		cv::imencode(".png", image, buffer, {cv::IMWRITE_PNG_COMPRESSION, 1});
+		break;
+	case Format::Raw:
+		buffer = ImageCodec::EncodeRaw(image);
+		break;
+	case Format::Qoi:
+		buffer = ImageCodec::EncodeQoi(image);
+		break;
+	default:
+		cv::imencode(".jpg", image, buffer, {cv::IMWRITE_JPEG_QUALITY, jpegQuality});
+		break;
+	}
+	if (buffer.empty())
+	{
+		throw std::runtime_error("Unable to encode image as " + ImageCodec::Name(format));
+	}
+	return buffer;
+}
+
+cv::Mat ImageCodec::Decode(const uchar *data, size_t size, int flags)
+{
+	if (size >= 4 && std::memcmp(data, "LRAW", 4) == 0)
+	{
+		return ImageCodec::DecodeRaw(data, size);
+	}
+	if (size >= 4 && std::memcmp(data, "qoif", 4) == 0)
+	{
+		return ImageCodec::DecodeQoi(data, size);
+	}
+	return cv::imdecode(cv::Mat(1, static_cast<int>(size), CV_8U, const_cast<uchar *>(data)), flags);
+}
+
+cv::Mat ImageCodec::DecodeRegion(const uchar *data, size_t size, const cv::Rect &region)
+{
+	// Only the rows and block columns of the region are decoded from a JPEG
+	if (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF)
+	{
+		cv::Mat image = ImageCodec::DecodeJpegRegion(data, size, region);
+		if (!image.empty())
+		{
+			return image;
+		}
+	}
+	// Other formats, or no partial decoder: full decode, then crop
+	cv::Mat image = ImageCodec::Decode(data, size, cv::IMREAD_COLOR);
+	if (image.empty() || (region & cv::Rect(0, 0, image.cols, image.rows)) != region)
+	{
+		return cv::Mat();
+	}
+	return image(region).clone();
+}
+
+void ImageCodec::Write(const std::string &filePath, const cv::Mat &image, Format format, int jpegQuality)
+{
+	const std::vector<uchar> buffer = ImageCodec::Encode(image, format, jpegQuality);
+	// Replaced rather than rewritten, another generation may share the file through a hard link
+	std::error_code error;
+	std::filesystem::remove(filePath, error);
+	std::ofstream file(filePath, std::ios::binary | std::ios::trunc);
+	if (!file.is_open() || !file.write(reinterpret_cast<const char *>(buffer.data()), buffer.size()))
+	{
+		throw std::runtime_error("Unable to write " + filePath);
+	}
+}
+
+cv::Mat ImageCodec::Read(const std::string &filePath, int flags)
+{
+	std::ifstream file(filePath, std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+	{
+		return cv::Mat();
+	}
+	const size_t size = file.tellg();
+	std::vector<uchar> buffer(size);
+	file.seekg(0);
+	if (!file.read(reinterpret_cast<char *>(buffer.data()), size))
+	{
+		return cv::Mat();
+	}
+	return ImageCodec::Decode(buffer.data(), buffer.size(), flags);
+}
+
+std::vector<uchar> ImageCodec::EncodeRaw(const cv::Mat &image)
+{
+	// Magic, rows, cols, type, then the pixels row after row
+	const int32_t header[3] = {image.rows, image.cols, image.type()};
+	const size_t rowSize = image.cols * image.elemSize();
+	std::vector<uchar> buffer(4 + sizeof(header) + image.rows * rowSize);
+	std::memcpy(buffer.data(), "LRAW", 4);
+	std::memcpy(buffer.data() + 4, header, sizeof(header));
+	uchar *pixels = buffer.data() + 4 + sizeof(header);
+	for (int y = 0; y < image.rows; y++)
+	{
+		std::memcpy(pixels + y * rowSize, image.ptr<uchar>(y), rowSize);
+	}
+	return buffer;
+}
+
+cv::Mat ImageCodec::DecodeRaw(const uchar *data, size_t size)
+{
+	int32_t header[3];
+	if (size < 4 + sizeof(header))
+	{
+		return cv::Mat();
+	}
+	std::memcpy(header, data + 4, sizeof(header));
+	// Dimensions are checked against the payload before anything is allocated
+	if (header[0] <= 0 || header[1] <= 0 || header[2] != CV_MAT_TYPE(header[2]))
+	{
+		return cv::Mat();
+	}
+	const size_t elemSize = CV_ELEM_SIZE(header[2]);
+	const size_t pixels = static_cast<size_t>(header[0]) * header[1];
+	if (pixels > (size - 4 - sizeof(header)) / elemSize)
+	{
+		return cv::Mat();
+	}
+	const size_t pixelSize = pixels * elemSize;
+	cv::Mat image(header[0], header[1], header[2]);
+	std::memcpy(image.data, data + 4 + sizeof(header), pixelSize);
+	return image;
+}
+
+// QOI (https://qoiformat.org), pixels are stored in RGB(A) order
+
+namespace
+{
+	struct QoiPixel
+	{
+		uchar r, g, b, a;
+		bool operator==(const QoiPixel &other) const
+		{
+			return r == other.r && g == other.g && b == other.b && a == other.a;
+		}
+	};
+
+	inline int QoiHash(const QoiPixel &px)
+	{
+		return (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64;
+	}
+
+	inline void PutBigEndian(std::vector<uchar> &buffer, uint32_t value)
+	{
+		buffer.push_back(value >> 24);
+		buffer.push_back(value >> 16);
+		buffer.push_back(value >> 8);
+		buffer.push_back(value);
+	}
+
+	inline uint32_t GetBigEndian(const uchar *data)
+	{
+		return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | uint32_t(data[3]);
+	}
+}
+
+std::vector<uchar> ImageCodec::EncodeQoi(const cv::Mat &image)
+{
+	const int channels = image.channels();
+	if (image.depth() != CV_8U || (channels != 3 && channels != 4))
+	{
+		return ImageCodec::EncodeRaw(image);
+	}
+
+	std::vector<uchar> buffer;
+	buffer.reserve(14 + image.total() * (channels + 1) + 8);
+	buffer.insert(buffer.end(), {'q', 'o', 'i', 'f'});
+	PutBigEndian(buffer, image.cols);
+	PutBigEndian(buffer, image.rows);
+	buffer.push_back(channels);
+	buffer.push_back(0);
+
+	QoiPixel index[64] = {};
+	QoiPixel previous = {0, 0, 0, 255};
+	int run = 0;
+	const size_t last = image.total() - 1;
+	size_t position = 0;
+	for (int y = 0; y < image.rows; y++)
+	{
+		const uchar *row = image.ptr<uchar>(y);
+		for (int x = 0; x < image.cols; x++, position++)
+		{
+			const uchar *bgr = row + x * channels;
+			const QoiPixel px = {bgr[2], bgr[1], bgr[0], channels == 4 ? bgr[3] : uchar(255)};
+			if (px == previous)
+			{
+				run++;
+				if (run == 62 || position == last)
+				{
+					buffer.push_back(0xc0 | (run - 1));
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0)
+			{
+				buffer.push_back(0xc0 | (run - 1));
+				run = 0;
+			}
+			const int hash = QoiHash(px);
+			if (index[hash] == px)
+			{
+				buffer.push_back(hash);
+			}
+			else
+			{
+				index[hash] = px;
+				if (px.a == previous.a)
+				{
+					const signed char vr = px.r - previous.r;
+					const signed char vg = px.g - previous.g;
+					const signed char vb = px.b - previous.b;
+					const signed char vgr = vr - vg;
+					const signed char vgb = vb - vg;
+					if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+					{
+						buffer.push_back(0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+					}
+					else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8)
+					{
+						buffer.push_back(0x80 | (vg + 32));
+						buffer.push_back((vgr + 8) << 4 | (vgb + 8));
+					}
+					else
+					{
+						buffer.insert(buffer.end(), {0xfe, px.r, px.g, px.b});
+					}
+				}
+				else
+				{
+					buffer.insert(buffer.end(), {0xff, px.r, px.g, px.b, px.a});
+				}
+			}
+			previous = px;
+		}
+	}
+	buffer.insert(buffer.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+	return buffer;
+}
+
+cv::Mat ImageCodec::DecodeQoi(const uchar *data, size_t size)
+{
+	if (size < 14 + 8)
+	{
+		return cv::Mat();
+	}
+	const uint32_t cols = GetBigEndian(data + 4);
+	const uint32_t rows = GetBigEndian(data + 8);
+	const int channels = data[12];
+	if ((channels != 3 && channels != 4) || cols == 0 || rows == 0 || cols > INT_MAX || rows > INT_MAX)
+	{
+		return cv::Mat();
+	}
+	// A chunk encodes up to 62 pixels, bigger claimed sizes can not come from this payload
+	if (static_cast<uint64_t>(rows) * cols > static_cast<uint64_t>(size - 14 - 8) * 62)
+	{
+		return cv::Mat();
+	}
+	cv::Mat image(rows, cols, CV_MAKETYPE(CV_8U, channels));
+
+	QoiPixel index[64] = {};
+	QoiPixel px = {0, 0, 0, 255};
+	int run = 0;
+	size_t position = 14;
+	const size_t end = size - 8;
+	for (uint32_t y = 0; y < rows; y++)
+	{
+		uchar *row = image.ptr<uchar>(y);
+		for (uint32_t x = 0; x < cols; x++)
+		{
+			if (run > 0)
+			{
+				run--;
+			}
+			else if (position < end)
+			{
+				const uchar b1 = data[position++];
+				// Operands of a chunk cut by the end of the data
+				const size_t operands = b1 == 0xfe ? 3 : b1 == 0xff ? 4 : (b1 & 0xc0) == 0x80 ? 1 : 0;
+				if (end - position < operands)
+				{
+					return cv::Mat();
+				}
+				if (b1 == 0xfe)
+				{
+					px.r = data[position++];
+					px.g = data[position++];
+					px.b = data[position++];
+				}
+				else if (b1 == 0xff)
+				{
+					px.r = data[position++];
+					px.g = data[position++];
+					px.b = data[position++];
+					px.a = data[position++];
+				}
+				else if ((b1 & 0xc0) == 0x00)
+				{
+					px = index[b1];
+				}
+				else if ((b1 & 0xc0) == 0x40)
+				{
+					px.r += ((b1 >> 4) & 0x03) - 2;
+					px.g += ((b1 >> 2) & 0x03) - 2;
+					px.b += (b1 & 0x03) - 2;
+				}
+				else if ((b1 & 0xc0) == 0x80)
+				{
+					const uchar b2 = data[position++];
+					const int vg = (b1 & 0x3f) - 32;
+					px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+					px.g += vg;
+					px.b += vg - 8 + (b2 & 0x0f);
+				}
+				else
+				{
+					run = b1 & 0x3f;
+				}
+				index[QoiHash(px)] = px;
+			}
+			else
+			{
+				// Pixels past the last chunk
+				return cv::Mat();
+			}
+			uchar *bgr = row + x * channels;
+			bgr[0] = px.b;
+			bgr[1] = px.g;
+			bgr[2] = px.r;
+			if (channels == 4)
+			{
+				bgr[3] = px.a;
+			}
+		}
+	}
+	return image;
+}
+
+cv::Mat ImageCodec::DecodeJpegRegion(const uchar *data, size_t size, const cv::Rect &region)
+{
+#if defined(HAVE_LIBJPEG) && defined(LIBJPEG_TURBO_VERSION_NUMBER) && LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+	jpeg_decompress_struct info;
+	JpegError error;
+	info.err = jpeg_std_error(&error.manager);
+	error.manager.error_exit = JpegErrorExit;
+	cv::Mat image, row;
+	if (setjmp(error.jump))
+	{
+		jpeg_destroy_decompress(&info);
+		return cv::Mat();
+	}
+	jpeg_create_decompress(&info);
+	jpeg_mem_src(&info, data, size);
+	jpeg_save_markers(&info, JPEG_APP0 + 1, 0xFFFF);
+	jpeg_read_header(&info, TRUE);
+	info.out_color_space = JCS_EXT_BGR;
+	jpeg_start_decompress(&info);
+	// Rotated images are left to OpenCV, the region is given in displayed coordinates
+	if (ExifOrientation(info) != 1 || info.output_components != 3 || region.x < 0 || region.y < 0 || region.width <= 0 || region.height <= 0 ||
+		region.x + region.width > static_cast<int>(info.output_width) || region.y + region.height > static_cast<int>(info.output_height))
+	{
+		jpeg_destroy_decompress(&info);
+		return cv::Mat();
+	}
+
+	// A margin of one block keeps chroma upsampling identical to a full decode at the region border.
+	// The decoder widens the columns to whole blocks, rows above the margin are skipped.
+	const int margin = 16;
+	const int top = std::max(0, region.y - margin);
+	JDIMENSION x = std::max(0, region.x - margin);
+	JDIMENSION width = std::min<int>(info.output_width, region.x + region.width + margin) - x;
+	jpeg_crop_scanline(&info, &x, &width);
+	if (top > 0)
+	{
+		jpeg_skip_scanlines(&info, top);
+	}
+	image.create(region.height, region.width, CV_8UC3);
+	row.create(1, width, CV_8UC3);
+	for (int y = top; y < region.y + region.height; y++)
+	{
+		JSAMPROW rowPointer = row.data;
+		jpeg_read_scanlines(&info, &rowPointer, 1);
+		if (y >= region.y)
+		{
+			std::memcpy(image.ptr(y - region.y), row.data + (region.x - x) * 3, region.width * 3);
+		}
+	}
+	// Rows below the region are never decoded
+	jpeg_destroy_decompress(&info);
+	return image;
+#else
+	(void)data;
+	(void)size;
+	(void)region;
+	return cv::Mat();
+#endif
+}
@@ -0,0 +1,317 @@
+#include "image_dependencies.h"
+#include "dataset_manifest.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <unordered_set>
+
+const std::string ImageDependencies::FileName = "dependencies.LFD";
+
+std::mutex ImageDependencies::mutex;
+std::unordered_map<std::string, ImageDependencies::Directory> ImageDependencies::directories;
+
+namespace
+{
+	std::string DirectoryKey(const std::string &directoryPath)
+	{
+		std::string key = std::filesystem::path(directoryPath).lexically_normal().generic_string();
+		while (key.size() > 1 && key.back() == '/')
+		{
+			key.pop_back();
+		}
+		return key;
+	}
+}
+
+uint64_t ImageDependencies::Hash(const void *data, size_t size, uint64_t hash)
+{
+	// FNV-1a
+	const unsigned char *bytes = static_cast<const unsigned char *>(data);
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+uint64_t ImageDependencies::Hash(const std::string &text, uint64_t hash)
+{
+	return ImageDependencies::Hash(text.data(), text.size(), hash);
+}
+
+uint64_t ImageDependencies::HashFile(const std::string &filePath)
+{
+	std::ifstream file(filePath, std::ios::binary);
+	if (!file.is_open())
+	{
+		throw std::runtime_error("Unable to open " + filePath);
+	}
+	uint64_t hash = 14695981039346656037ull;
+	std::vector<char> buffer(1 << 16);
+	while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0)
+	{
+		hash = ImageDependencies::Hash(buffer.data(), file.gcount(), hash);
+	}
+	return hash;
+}
+
+std::vector<bool> ImageDependencies::Outdated(const std::string &directoryPath, const std::vector<std::string> &inputs, char stage, const std::vector<uint64_t> &configHashes)
+{
+	// Outputs are looked up in the manifest rather than one stat each
+	std::unordered_set<std::string> existing;
+	for (const auto &record : DatasetManifest::GetRecords(directoryPath))
+	{
+		existing.insert(record.name);
+	}
+
+	std::lock_guard<std::mutex> lock(ImageDependencies::mutex);
+	Directory &directory = ImageDependencies::Load(directoryPath);
+	std::vector<bool> outdated(inputs.size(), true);
+	for (size_t i = 0; i < inputs.size(); i++)
+	{
+		const auto found = directory.find(stage + inputs[i]);
+		if (found == directory.end())
+		{
+			continue;
+		}
+		Dependency &dependency = found->second;
+		dependency.used = true;
+		if (dependency.configHash != configHashes[i])
+		{
+			continue;
+		}
+		// Content is hashed again only when size or mtime moved
+		int64_t size, mtime;
+		ImageDependencies::Stat(inputs[i], size, mtime);
+		if (size != dependency.size || mtime != dependency.mtime)
+		{
+			if (size < 0 || ImageDependencies::HashFile(inputs[i]) != dependency.contentHash)
+			{
+				continue;
+			}
+			dependency.size = size;
+			dependency.mtime = mtime;
+		}
+		bool complete = true;
+		for (const auto &output : dependency.outputs)
+		{
+			complete = complete && existing.count(output);
+		}
+		outdated[i] = !complete;
+	}
+	return outdated;
+}
+
+void ImageDependencies::Update(const std::string &directoryPath, const std::string &input, char stage, uint64_t configHash, const std::vector<std::string> &outputs)
+{
+	Dependency dependency = {input, stage, outputs, 0, 0, ImageDependencies::HashFile(input), configHash, true};
+	ImageDependencies::Stat(input, dependency.size, dependency.mtime);
+
+	std::lock_guard<std::mutex> lock(ImageDependencies::mutex);
+	ImageDependencies::Load(directoryPath)[stage + input] = std::move(dependency);
+}
+
+void ImageDependencies::Save(const std::string &directoryPath)
+{
+	std::lock_guard<std::mutex> lock(ImageDependencies::mutex);
+	const Directory &directory = ImageDependencies::Load(directoryPath);
+
+	// Outputs of an entry are stored as one '\n' separated string
+	std::string strings;
+	std::vector<Entry> entries;
+	for (const auto &[key, dependency] : directory)
+	{
+		Entry entry;
+		std::memset(&entry, 0, sizeof(Entry));
+		entry.inputOffset = strings.size();
+		entry.inputLength = dependency.input.size();
+		entry.stage = dependency.stage;
+		strings += dependency.input;
+		entry.outputsOffset = strings.size();
+		for (size_t i = 0; i < dependency.outputs.size(); i++)
+		{
+			strings += (i ? "\n" : "") + dependency.outputs[i];
+		}
+		entry.outputsLength = strings.size() - entry.outputsOffset;
+		entry.size = dependency.size;
+		entry.mtime = dependency.mtime;
+		entry.contentHash = dependency.contentHash;
+		entry.configHash = dependency.configHash;
+		entries.push_back(entry);
+	}
+	Header header = {{'L', 'F', 'D', 'P'}, 1, entries.size(), strings.size()};
+
+	const std::string filePath = DirectoryKey(directoryPath) + "/" + ImageDependencies::FileName;
+	const std::string temporaryPath = filePath + ".tmp";
+	{
+		std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open() ||
+			!file.write(reinterpret_cast<const char *>(&header), sizeof(Header)) ||
+			!file.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(Entry)) ||
+			!file.write(strings.data(), strings.size()))
+		{
+			throw std::runtime_error("Unable to write " + temporaryPath);
+		}
+	}
+	std::filesystem::rename(temporaryPath, filePath);
+}
+
+std::unordered_set<std::string> ImageDependencies::Sweep(const std::string &directoryPath, char stage)
+{
+	std::unordered_set<std::string> outputs;
+	{
+		// Inputs of the stage not seen during this run are no longer part of the dataset
+		std::lock_guard<std::mutex> lock(ImageDependencies::mutex);
+		Directory &directory = ImageDependencies::Load(directoryPath);
+		for (auto it = directory.begin(); it != directory.end();)
+		{
+			if (it->second.stage == stage && !it->second.used)
+			{
+				it = directory.erase(it);
+				continue;
+			}
+			outputs.insert(it->second.outputs.begin(), it->second.outputs.end());
+			++it;
+		}
+	}
+	ImageDependencies::Save(directoryPath);
+	return outputs;
+}
+
+size_t ImageDependencies::Carry(const std::string &previousPath, const std::string &directoryPath)
+{
+	// Records of a previous generation whose input did not change, with their outputs hard-linked:
+	// nothing is generated again and the previous generation is never written to
+	size_t carried = 0;
+	{
+		std::lock_guard<std::mutex> lock(ImageDependencies::mutex);
+		const Directory &previous = ImageDependencies::Load(previousPath);
+		Directory &directory = ImageDependencies::Load(directoryPath);
+		const std::string previousKey = DirectoryKey(previousPath) + "/";
+		const std::string key = DirectoryKey(directoryPath) + "/";
+		// Inputs inside the previous generation (augmentations) are outputs of the first pass, found under the new directory
+		for (const bool generatedInputs : {false, true})
+		{
+			for (const auto &[recordKey, previousDependency] : previous)
+			{
+				const std::string input = std::filesystem::path(previousDependency.input).lexically_normal().generic_string();
+				if (input.starts_with(previousKey) != generatedInputs)
+				{
+					continue;
+				}
+				Dependency dependency = previousDependency;
+				dependency.used = false;
+				if (generatedInputs)
+				{
+					dependency.input = directoryPath + input.substr(previousKey.size());
+				}
+				int64_t size, mtime;
+				ImageDependencies::Stat(dependency.input, size, mtime);
+				if (size != dependency.size || mtime != dependency.mtime)
+				{
+					if (size < 0 || ImageDependencies::HashFile(dependency.input) != dependency.contentHash)
+					{
+						continue;
+					}
+					dependency.size = size;
+					dependency.mtime = mtime;
+				}
+				bool linked = true;
+				for (const auto &output : dependency.outputs)
+				{
+					std::error_code error;
+					std::filesystem::create_hard_link(previousKey + output, key + output, error);
+					linked = linked && (!error || error == std::errc::file_exists);
+				}
+				// An output that could not be linked is generated again, the other ones are swept as stale
+				if (linked)
+				{
+					directory[dependency.stage + dependency.input] = std::move(dependency);
+					carried++;
+				}
+			}
+		}
+	}
+	ImageDependencies::Save(directoryPath);
+	DatasetManifest::Invalidate(directoryPath);
+	return carried;
+}
+
+ImageDependencies::Directory &ImageDependencies::Load(const std::string &directoryPath)
+{
+	const std::string key = DirectoryKey(directoryPath);
+	const auto found = ImageDependencies::directories.find(key);
+	if (found != ImageDependencies::directories.end())
+	{
+		return found->second;
+	}
+	Directory &directory = ImageDependencies::directories[key];
+
+	// Single open, single read, a missing or invalid file means nothing is up to date
+	std::ifstream file(key + "/" + ImageDependencies::FileName, std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+	{
+		return directory;
+	}
+	const size_t size = file.tellg();
+	std::vector<char> buffer(size);
+	file.seekg(0);
+	if (size < sizeof(Header) || !file.read(buffer.data(), size))
+	{
+		return directory;
+	}
+	Header header;
+	std::memcpy(&header, buffer.data(), sizeof(Header));
+	if (std::string(header.magic, 4) != "LFDP" || header.version != 1 || header.count > (size - sizeof(Header)) / sizeof(Entry))
+	{
+		return directory;
+	}
+	const size_t stringsOffset = sizeof(Header) + header.count * sizeof(Entry);
+	if (header.stringsSize != size - stringsOffset)
+	{
+		return directory;
+	}
+	const Entry *entries = reinterpret_cast<const Entry *>(buffer.data() + sizeof(Header));
+	const char *strings = buffer.data() + stringsOffset;
+	// Every string of an entry must lie inside the strings block
+	auto inside = [&](uint64_t offset, uint64_t length)
+	{
+		return offset <= header.stringsSize && length <= header.stringsSize - offset;
+	};
+	for (uint64_t i = 0; i < header.count; i++)
+	{
+		const Entry &entry = entries[i];
+		if (!inside(entry.inputOffset, entry.inputLength) || !inside(entry.outputsOffset, entry.outputsLength))
+		{
+			directory.clear();
+			return directory;
+		}
+		Dependency dependency = {std::string(strings + entry.inputOffset, entry.inputLength), static_cast<char>(entry.stage), {}, entry.size, entry.mtime, entry.contentHash, entry.configHash, false};
+		const std::string outputs(strings + entry.outputsOffset, entry.outputsLength);
+		for (size_t start = 0; start < outputs.size();)
+		{
+			size_t end = outputs.find('\n', start);
+			if (end == std::string::npos)
+			{
+				end = outputs.size();
+			}
+			dependency.outputs.push_back(outputs.substr(start, end - start));
+			start = end + 1;
+		}
+		directory[dependency.stage + dependency.input] = std::move(dependency);
+	}
+	return directory;
+}
+
+void ImageDependencies::Stat(const std::string &filePath, int64_t &size, int64_t &mtime)
+{
+	std::error_code error;
+	size = std::filesystem::file_size(filePath, error);
+	mtime = std::filesystem::last_write_time(filePath, error).time_since_epoch().count();
+	if (error)
+	{
+		size = -1;
+		mtime = -1;
+	}
+}
@@ -0,0 +1,135 @@
+#include "image_pack.h"
+
+#include <filesystem>
+#include <fstream>
+#include <cstring>
+
+const std::string ImagePack::Extension = ".LFP";
+
+void ImagePack::Save(const std::string &filePath, const std::vector<cv::Mat> &images, const std::vector<std::string> &names, ImageCodec::Format format, const std::vector<std::vector<uchar>> &encoded)
+{
+	// Encode every plane first so the whole file is written at once
+	std::vector<std::vector<uchar>> payloads(images.size());
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		payloads[i] = i < encoded.size() && !encoded[i].empty() ? encoded[i] : ImageCodec::Encode(images[i], format);
+	}
+
+	// Header and index
+	Header header = {{'L', 'F', 'P', 'K'}, 1, static_cast<uint32_t>(images.size()), 0};
+	std::vector<Entry> entries(images.size());
+	uint64_t offset = sizeof(Header) + entries.size() * sizeof(Entry);
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		Entry &entry = entries[i];
+		std::memset(&entry, 0, sizeof(Entry));
+		std::strncpy(entry.name, names[i].c_str(), sizeof(entry.name) - 1);
+		entry.rows = images[i].rows;
+		entry.cols = images[i].cols;
+		entry.type = images[i].type();
+		entry.offset = offset;
+		entry.size = payloads[i].size();
+		offset += entry.size;
+	}
+
+	std::vector<char> buffer(offset);
+	std::memcpy(buffer.data(), &header, sizeof(Header));
+	std::memcpy(buffer.data() + sizeof(Header), entries.data(), entries.size() * sizeof(Entry));
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		std::memcpy(buffer.data() + entries[i].offset, payloads[i].data(), payloads[i].size());
+	}
+
+	// Replaced rather than rewritten, another generation may share the file through a hard link
+	std::error_code error;
+	std::filesystem::remove(filePath, error);
+	std::ofstream file(filePath, std::ios::binary | std::ios::trunc);
+	if (!file.is_open() || !file.write(buffer.data(), buffer.size()))
+	{
+		throw std::runtime_error("Unable to write " + filePath);
+	}
+}
+
+std::vector<cv::Mat> ImagePack::Load(const std::string &filePath, std::vector<std::string> &names, std::vector<std::vector<uchar>> *payloads)
+{
+	// Single open, single read
+	std::ifstream file(filePath, std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+	{
+		throw std::runtime_error("Unable to open " + filePath);
+	}
+	const size_t size = file.tellg();
+	std::vector<uchar> buffer(size);
+	file.seekg(0);
+	if (size < sizeof(Header) || !file.read(reinterpret_cast<char *>(buffer.data()), size))
+	{
+		throw std::runtime_error("Unable to read " + filePath);
+	}
+	return ImagePack::Decode(buffer.data(), size, names, filePath, payloads);
+}
+
+size_t ImagePack::Count(const std::string &filePath)
+{
+	// Planes of a pack, from its header only
+	std::ifstream file(filePath, std::ios::binary);
+	Header header;
+	if (!file.is_open() || !file.read(reinterpret_cast<char *>(&header), sizeof(Header)) || std::memcmp(header.magic, "LFPK", 4) != 0 || header.version != 1)
+	{
+		throw std::runtime_error("Invalid image pack " + filePath);
+	}
+	return header.count;
+}
+
+std::vector<cv::Mat> ImagePack::Decode(const uchar *data, size_t size, std::vector<std::string> &names, const std::string &filePath, std::vector<std::vector<uchar>> *payloads)
+{
+	if (size < sizeof(Header))
+	{
+		throw std::runtime_error("Invalid image pack " + filePath);
+	}
+	Header header;
+	std::memcpy(&header, data, sizeof(Header));
+	if (std::memcmp(header.magic, "LFPK", 4) != 0 || header.version != 1 || sizeof(Header) + header.count * sizeof(Entry) > size)
+	{
+		throw std::runtime_error("Invalid image pack " + filePath);
+	}
+
+	std::vector<cv::Mat> images;
+	names.clear();
+	if (payloads)
+	{
+		payloads->clear();
+	}
+	for (uint32_t i = 0; i < header.count; i++)
+	{
+		Entry entry;
+		std::memcpy(&entry, data + sizeof(Header) + i * sizeof(Entry), sizeof(Entry));
+		if (entry.offset + entry.size > size)
+		{
+			throw std::runtime_error("Invalid image pack " + filePath);
+		}
+		cv::Mat image = ImageCodec::Decode(data + entry.offset, entry.size, cv::IMREAD_UNCHANGED);
+		if (image.empty())
+		{
+			throw std::runtime_error("Unable to decode " + std::string(entry.name) + " from " + filePath);
+		}
+		images.push_back(image);
+		names.push_back(entry.name);
+		if (payloads)
+		{
+			payloads->emplace_back(data + entry.offset, data + entry.offset + entry.size);
+		}
+	}
+	return images;
+}
+
+cv::Mat ImagePack::Get(const std::vector<cv::Mat> &images, const std::vector<std::string> &names, const std::string &name)
+{
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		if (names[i] == name)
+		{
+			return images[i];
+		}
+	}
+	return cv::Mat();
+}
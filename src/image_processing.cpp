@@ -1,6 +1,12 @@
 #include "image_processing.h"
 
 #include <random>
+#include <sstream>
+
+int ImageProcessing::orbFeatures = 500;
+bool ImageProcessing::keyPointFeatures = false;
+ImageProcessing::Segmentation ImageProcessing::segmentation = ImageProcessing::Segmentation::Heuristic;
+int ImageProcessing::segmentationScale = 1;
 
 void ImageProcessing::Rotate(cv::Mat &image, double minDistr, double maxDistr)
 {
@@ -152,12 +158,22 @@ void ImageProcessing::EqualizeHistogramValue(cv::Mat &image)
 	cv::cvtColor(hsvImage, image, cv::COLOR_HSV2BGR);
 }
 
+cv::Ptr<cv::ORB> &ImageProcessing::GetORBDetector()
+{
+	// One detector per thread, only rebuilt when the number of features changes
+	thread_local cv::Ptr<cv::ORB> orb;
+	if (!orb || orb->getMaxFeatures() != ImageProcessing::orbFeatures)
+	{
+		orb = cv::ORB::create(ImageProcessing::orbFeatures);
+	}
+	return orb;
+}
+
 void ImageProcessing::DetectORBKeyPoints(cv::Mat &image)
 {
 	// ORB detector
-	cv::Ptr<cv::ORB> orb = cv::ORB::create();
 	std::vector<cv::KeyPoint> keypoints;
-	orb->detect(image, keypoints);
+	ImageProcessing::GetORBDetector()->detect(image, keypoints);
 	for (const cv::KeyPoint &kp : keypoints)
 	{
 		cv::Point2f pt = kp.pt;
@@ -165,50 +181,41 @@ void ImageProcessing::DetectORBKeyPoints(cv::Mat &image)
 	}
 }
 
-void ImageProcessing::ExtractLeafAndRescale(cv::Mat &image)
+bool ImageProcessing::IsLeafPixel(const cv::Vec3b &pixel)
 {
-	cv::Mat originalImage = image.clone();
-	cv::Mat hsvImage;
-	// Cut
-	cv::cvtColor(image, hsvImage, cv::COLOR_BGR2HSV);
-	for (int i = 0; i < originalImage.rows; i++)
+	// Same cut as the second pass of the heuristic segmentation
+	cv::Vec3b BGR = pixel;
+	uchar value = BGR[0];
+	if (BGR[2] < value)
 	{
-		for (int j = 0; j < originalImage.cols; j++)
-		{
-			cv::Vec3b &BGR = image.at<cv::Vec3b>(i, j);
-			double value = BGR[0];
-			if (BGR[2] < value)
-			{
-				value = BGR[2];
-			}
-			BGR[1] = (BGR[1] < value ? 0 : BGR[1] - value);
-			BGR[0] = (BGR[0] < value ? 0 : BGR[0] - value);
-			BGR[2] = (BGR[2] < value ? 0 : BGR[2] - value);
-			if (hsvImage.at<cv::Vec3b>(i, j)[2] < 10)
-			{
-				BGR[2] = 0;
-				BGR[1] = 0;
-				BGR[0] = 0;
-			}
-			if (BGR[2] >= BGR[1] - 5 && BGR[2] >= BGR[0] - 5 && abs(BGR[1] - BGR[0]) < 20)
-			{
-				BGR[2] = 0;
-				BGR[1] = 0;
-				BGR[0] = 0;
-			}
-			if (BGR[0] >= BGR[1] - 5 && BGR[0] >= BGR[2] - 5 && abs(BGR[1] - BGR[2]) < 20)
-			{
-				BGR[2] = 0;
-				BGR[1] = 0;
-				BGR[0] = 0;
-			}
-		}
+		value = BGR[2];
 	}
-	image = originalImage.clone();
+	if (std::max({BGR[0], BGR[1], BGR[2]}) < 10)
+	{
+		return false;
+	}
+	BGR[1] = (BGR[1] < value ? 0 : BGR[1] - value);
+	BGR[0] = (BGR[0] < value ? 0 : BGR[0] - value);
+	BGR[2] = (BGR[2] < value ? 0 : BGR[2] - value);
+	if (BGR[2] >= BGR[1] - 2 && BGR[2] >= BGR[0] - 2 && abs(BGR[1] - BGR[0]) < 15)
+	{
+		return false;
+	}
+	if (BGR[0] >= BGR[1] - 2 && BGR[0] >= BGR[2] - 2 && abs(BGR[1] - BGR[2]) < 20)
+	{
+		return false;
+	}
+	return 0.114 * BGR[0] + 0.587 * BGR[1] + 0.299 * BGR[2] >= 0.5;
+}
+
+cv::Mat ImageProcessing::HeuristicLeafMask(const cv::Mat &originalImage, int erosionSize)
+{
+	cv::Mat image;
+	cv::Mat hsvImage;
 	// Get convexhull points and crop
 	std::vector<cv::Point> convexHullPoints;
 	cv::Mat grayImage;
-	cv::cvtColor(image, grayImage, cv::COLOR_BGR2GRAY);
+	cv::cvtColor(originalImage, grayImage, cv::COLOR_BGR2GRAY);
 	std::vector<std::vector<cv::Point>> contours;
 	cv::findContours(grayImage, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_NONE);
 	std::vector<cv::Point> allPoints;
@@ -220,12 +227,11 @@ void ImageProcessing::ExtractLeafAndRescale(cv::Mat &image)
 	{
 		cv::convexHull(cv::Mat(allPoints), convexHullPoints);
 		// Crop
-		cv::Mat mask = cv::Mat::zeros(image.size(), CV_8UC1);
+		cv::Mat mask = cv::Mat::zeros(originalImage.size(), CV_8UC1);
 		std::vector<std::vector<cv::Point>> contourVector = {convexHullPoints};
 		cv::drawContours(mask, contourVector, 0, cv::Scalar(255), cv::FILLED);
-		cv::Mat croppedImage = cv::Mat::zeros(image.size(), image.type());
-		image.copyTo(croppedImage, mask);
-		image = croppedImage;
+		image = cv::Mat::zeros(originalImage.size(), originalImage.type());
+		originalImage.copyTo(image, mask);
 	}
 	else
 	{
@@ -269,29 +275,270 @@ void ImageProcessing::ExtractLeafAndRescale(cv::Mat &image)
 	cv::cvtColor(image, grayImage, cv::COLOR_BGR2GRAY);
 	contours = std::vector<std::vector<cv::Point>>();
 	cv::findContours(grayImage, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_NONE);
+	cv::Mat mask = cv::Mat::zeros(originalImage.size(), CV_8UC1);
 	if (contours.empty())
 	{
-		return;
+		return mask;
 	}
-	cv::Mat mask = cv::Mat::zeros(originalImage.size(), CV_8UC1);
 	cv::fillPoly(mask, contours, cv::Scalar(255));
 	originalImage.copyTo(image, mask);
 	// Erode
-	int erosionSize = 9;
 	cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2 * erosionSize + 1, 2 * erosionSize + 1));
 	cv::erode(image, image, element, cv::Point(-1, -1), 1, cv::BORDER_CONSTANT, cv::Scalar(0));
 	cv::cvtColor(image, grayImage, cv::COLOR_BGR2GRAY);
 	cv::findContours(grayImage, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+	mask = cv::Mat::zeros(originalImage.size(), CV_8UC1);
 	if (contours.empty())
 	{
-		return;
+		return mask;
 	}
-	mask = cv::Mat::zeros(originalImage.size(), CV_8UC1);
 	cv::fillPoly(mask, contours, cv::Scalar(255));
-	originalImage.copyTo(image, mask);
-	// Resize
+	return mask;
+}
+
+void ImageProcessing::RefineMaskBorder(const cv::Mat &image, cv::Mat &mask, int band, int erosionSize)
+{
+	// Border band around the upsampled boundary
+	cv::Mat bandElement = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2 * band + 1, 2 * band + 1));
+	cv::Mat inner, outer;
+	cv::erode(mask, inner, bandElement);
+	cv::dilate(mask, outer, bandElement);
+	cv::Mat border = outer - inner;
+	// Pixels whose erosion depends on the border
+	cv::Mat erosionElement = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2 * erosionSize + 1, 2 * erosionSize + 1));
+	cv::Mat region;
+	cv::dilate(border, region, erosionElement);
+	// Full resolution cut, only evaluated inside the region
+	cv::Mat leaf = inner.clone();
+	for (int i = 0; i < image.rows; i++)
+	{
+		const uchar *regionRow = region.ptr<uchar>(i);
+		const cv::Vec3b *imageRow = image.ptr<cv::Vec3b>(i);
+		uchar *leafRow = leaf.ptr<uchar>(i);
+		for (int j = 0; j < image.cols; j++)
+		{
+			if (regionRow[j])
+			{
+				leafRow[j] = ImageProcessing::IsLeafPixel(imageRow[j]) ? 255 : 0;
+			}
+		}
+	}
+	cv::erode(leaf, leaf, erosionElement, cv::Point(-1, -1), 1, cv::BORDER_CONSTANT, cv::Scalar(0));
+	mask = inner | (leaf & border);
+}
+
+cv::Mat ImageProcessing::VegetationIndexLeafMask(const cv::Mat &image, Segmentation mode, int erosionSize)
+{
+	// Vegetation index as a single float channel
+	// ExG = 2G - R - B, ExGR = ExG - (1.4R - G)
+	cv::Mat coefficients;
+	if (mode == Segmentation::ExcessGreenRed)
+	{
+		coefficients = (cv::Mat_<float>(1, 3) << -1.0f, 3.0f, -2.4f);
+	}
+	else
+	{
+		coefficients = (cv::Mat_<float>(1, 3) << -1.0f, 2.0f, -1.0f);
+	}
+	cv::Mat floatImage, index;
+	image.convertTo(floatImage, CV_32F);
+	cv::transform(floatImage, index, coefficients);
+	// Otsu threshold on the rescaled index
+	cv::Mat index8U, mask;
+	cv::normalize(index, index8U, 0, 255, cv::NORM_MINMAX, CV_8U);
+	cv::threshold(index8U, mask, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+	// Remove speckles, fill holes, and erode like the heuristic does
+	cv::Mat element = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(5, 5));
+	cv::morphologyEx(mask, mask, cv::MORPH_OPEN, element);
+	std::vector<std::vector<cv::Point>> contours;
+	cv::findContours(mask, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+	mask = cv::Mat::zeros(image.size(), CV_8UC1);
+	if (contours.empty())
+	{
+		return mask;
+	}
+	cv::fillPoly(mask, contours, cv::Scalar(255));
+	element = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2 * erosionSize + 1, 2 * erosionSize + 1));
+	cv::erode(mask, mask, element, cv::Point(-1, -1), 1, cv::BORDER_CONSTANT, cv::Scalar(0));
+	return mask;
+}
+
+ImageProcessing::Segmentation ImageProcessing::ParseSegmentation(const std::string &name)
+{
+	if (name == "heuristic")
+	{
+		return Segmentation::Heuristic;
+	}
+	if (name == "exg")
+	{
+		return Segmentation::ExcessGreen;
+	}
+	if (name == "exgr")
+	{
+		return Segmentation::ExcessGreenRed;
+	}
+	throw std::runtime_error("Unknown segmentation mode: " + name + " (heuristic, exg, exgr)");
+}
+
+std::string ImageProcessing::FeatureSettings()
+{
+	// Settings that change the features of a sample, saved with the models trained on them
+	const char *segmentationName = "heuristic";
+	if (ImageProcessing::segmentation == Segmentation::ExcessGreen)
+	{
+		segmentationName = "exg";
+	}
+	else if (ImageProcessing::segmentation == Segmentation::ExcessGreenRed)
+	{
+		segmentationName = "exgr";
+	}
+	return "orb=" + std::to_string(ImageProcessing::orbFeatures) + " kp=" + (ImageProcessing::keyPointFeatures ? "1" : "0") + " seg=" + segmentationName + " segscale=" + std::to_string(ImageProcessing::segmentationScale);
+}
+
+void ImageProcessing::ApplyFeatureSetting(const std::string &key, const std::string &value)
+{
+	// Whole value as a number, rejecting trailing characters and out of range input
+	auto parseInteger = [&](int minimum, int maximum)
+	{
+		size_t end = 0;
+		int number = 0;
+		try
+		{
+			number = std::stoi(value, &end);
+		}
+		catch (const std::exception &)
+		{
+			end = 0;
+		}
+		if (end == 0 || end != value.size() || number < minimum || number > maximum)
+		{
+			throw std::runtime_error("Invalid " + key + " value: " + value + " (" + std::to_string(minimum) + " to " + std::to_string(maximum) + ")");
+		}
+		return number;
+	};
+	if (key == "orb")
+	{
+		ImageProcessing::orbFeatures = parseInteger(1, 100000);
+	}
+	else if (key == "kp")
+	{
+		ImageProcessing::keyPointFeatures = parseInteger(0, 1) == 1;
+	}
+	else if (key == "seg")
+	{
+		ImageProcessing::segmentation = ImageProcessing::ParseSegmentation(value);
+	}
+	else if (key == "segscale")
+	{
+		const int scale = parseInteger(1, 4);
+		if (scale == 3)
+		{
+			throw std::runtime_error("Invalid segscale value: " + value + " (1, 2, 4)");
+		}
+		ImageProcessing::segmentationScale = scale;
+	}
+	else
+	{
+		throw std::runtime_error("Unknown feature setting: " + key);
+	}
+}
+
+void ImageProcessing::ApplyFeatureSettings(const std::string &settings)
+{
+	std::istringstream stream(settings);
+	std::string setting;
+	while (stream >> setting)
+	{
+		const size_t separator = setting.find('=');
+		if (separator == std::string::npos)
+		{
+			throw std::runtime_error("Invalid feature setting: " + setting);
+		}
+		ImageProcessing::ApplyFeatureSetting(setting.substr(0, separator), setting.substr(separator + 1));
+	}
+}
+
+std::string ImageProcessing::ParseFeatureArgument(int argc, char *argv[], int &i)
+{
+	// Command-line flags shared by every tool that extracts features
+	const std::string arg = argv[i];
+	std::string key;
+	if (arg == "-kp")
+	{
+		ImageProcessing::ApplyFeatureSetting("kp", "1");
+		return "kp=1";
+	}
+	if (arg == "-orb")
+	{
+		key = "orb";
+	}
+	else if (arg == "-seg")
+	{
+		key = "seg";
+	}
+	else if (arg == "-segscale")
+	{
+		key = "segscale";
+	}
+	else
+	{
+		return "";
+	}
+	if (i + 1 >= argc)
+	{
+		throw std::runtime_error("Missing value for " + arg);
+	}
+	const std::string value = argv[++i];
+	ImageProcessing::ApplyFeatureSetting(key, value);
+	// Canonical form, as written by FeatureSettings
+	if (key == "orb")
+	{
+		return "orb=" + std::to_string(ImageProcessing::orbFeatures);
+	}
+	if (key == "segscale")
+	{
+		return "segscale=" + std::to_string(ImageProcessing::segmentationScale);
+	}
+	return key + "=" + value;
+}
+
+cv::Mat ImageProcessing::ExtractLeafMask(const cv::Mat &image)
+{
+	return ImageProcessing::ExtractLeafMask(image, ImageProcessing::segmentation, ImageProcessing::segmentationScale);
+}
+
+cv::Mat ImageProcessing::ExtractLeafMask(const cv::Mat &image, Segmentation mode, int scale)
+{
+	const int erosionSize = 9;
+	if (mode != Segmentation::Heuristic)
+	{
+		return ImageProcessing::VegetationIndexLeafMask(image, mode, erosionSize);
+	}
+	if (scale <= 1)
+	{
+		return ImageProcessing::HeuristicLeafMask(image, erosionSize);
+	}
+	// Segment a downsampled copy, then refine the upsampled boundary at full resolution
+	cv::Mat smallImage;
+	cv::resize(image, smallImage, cv::Size(), 1.0 / scale, 1.0 / scale, cv::INTER_AREA);
+	cv::Mat mask = ImageProcessing::HeuristicLeafMask(smallImage, std::max(1, erosionSize / scale));
+	cv::resize(mask, mask, image.size(), 0, 0, cv::INTER_LINEAR);
+	cv::threshold(mask, mask, 127, 255, cv::THRESH_BINARY);
+	ImageProcessing::RefineMaskBorder(image, mask, scale, erosionSize);
+	return mask;
+}
+
+cv::Rect ImageProcessing::LeafBoundingBox(const cv::Mat &mask)
+{
+	std::vector<std::vector<cv::Point>> contours;
+	cv::Mat contourMask = mask.clone();
+	cv::findContours(contourMask, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+	if (contours.empty())
+	{
+		return cv::Rect();
+	}
 	double maxArea = 0.0;
-	std::vector<cv::Point> maxContour;
+	std::vector<cv::Point> maxContour = contours[0];
 	for (const auto &contour : contours)
 	{
 		double area = cv::contourArea(contour);
@@ -301,21 +548,44 @@ void ImageProcessing::ExtractLeafAndRescale(cv::Mat &image)
 			maxContour = contour;
 		}
 	}
-	cv::Rect boundingBox = cv::boundingRect(maxContour);
+	return cv::boundingRect(maxContour);
+}
+
+cv::Mat ImageProcessing::RescaleLeafRegion(const cv::Mat &region, const cv::Mat &regionMask, cv::Size size)
+{
+	// Only the pixels of the leaf bounding box are needed, the full image is not
+	cv::Mat leafRegion = cv::Mat::zeros(region.size(), region.type());
+	region.copyTo(leafRegion, regionMask);
 	double scale = std::min(
-		(double)image.cols / boundingBox.width,
-		(double)image.rows / boundingBox.height);
-	cv::Mat leafRegion = image(boundingBox);
+		(double)size.width / region.cols,
+		(double)size.height / region.rows);
 	cv::Mat resizedLeaf;
 	cv::resize(leafRegion, resizedLeaf, cv::Size(), scale, scale, cv::INTER_AREA);
-	cv::Mat newImage(image.size(), image.type(), cv::Scalar::all(0));
+	cv::Mat newImage(size, region.type(), cv::Scalar::all(0));
 	cv::Rect roi(
 		(newImage.cols - resizedLeaf.cols) / 2,
 		(newImage.rows - resizedLeaf.rows) / 2,
 		resizedLeaf.cols,
 		resizedLeaf.rows);
 	resizedLeaf.copyTo(newImage(roi));
-	image = newImage.clone();
+	return newImage;
+}
+
+void ImageProcessing::RescaleLeaf(cv::Mat &image, const cv::Mat &mask)
+{
+	const cv::Rect boundingBox = ImageProcessing::LeafBoundingBox(mask);
+	if (boundingBox.empty())
+	{
+		image = cv::Mat::zeros(image.size(), image.type());
+		return;
+	}
+	image = ImageProcessing::RescaleLeafRegion(image(boundingBox), mask(boundingBox), image.size());
+}
+
+void ImageProcessing::ExtractLeafAndRescale(cv::Mat &image)
+{
+	cv::Mat mask = ImageProcessing::ExtractLeafMask(image);
+	ImageProcessing::RescaleLeaf(image, mask);
 }
 
 cv::Mat ImageProcessing::CalculateGLCM(const cv::Mat &img)
@@ -544,4 +814,67 @@ std::vector<double> ImageProcessing::ExtractColorCaracteristics(const cv::Mat &i
 	features.insert(features.end(), HSV.begin(), HSV.end());
 
 	return features;
-}
\ No newline at end of file
+}
+
+std::vector<double> ImageProcessing::ExtractKeyPointCaracteristics(const cv::Mat &image)
+{
+	std::vector<cv::KeyPoint> keypoints;
+	ImageProcessing::GetORBDetector()->detect(image, keypoints);
+	const size_t count = keypoints.size();
+	if (count == 0)
+	{
+		return std::vector<double>(11, 0.0);
+	}
+
+	// Response distribution
+	std::vector<double> responses;
+	double responseSum = 0.0, sizeSum = 0.0;
+	double xSum = 0.0, ySum = 0.0;
+	for (const cv::KeyPoint &kp : keypoints)
+	{
+		responses.push_back(kp.response);
+		responseSum += kp.response;
+		sizeSum += kp.size;
+		// Positions normalized by the image size
+		xSum += kp.pt.x / image.cols;
+		ySum += kp.pt.y / image.rows;
+	}
+	const double responseMean = responseSum / count;
+	const double xMean = xSum / count;
+	const double yMean = ySum / count;
+	// Spatial spread
+	double responseVariance = 0.0, xVariance = 0.0, yVariance = 0.0;
+	for (const cv::KeyPoint &kp : keypoints)
+	{
+		const double dr = kp.response - responseMean;
+		const double dx = kp.pt.x / image.cols - xMean;
+		const double dy = kp.pt.y / image.rows - yMean;
+		responseVariance += dr * dr;
+		xVariance += dx * dx;
+		yVariance += dy * dy;
+	}
+	std::nth_element(responses.begin(), responses.begin() + count / 2, responses.end());
+	const double responseMedian = responses[count / 2];
+	const auto [responseMin, responseMax] = std::minmax_element(responses.begin(), responses.end());
+
+	return {
+		static_cast<double>(count), responseMean, std::sqrt(responseVariance / count),
+		*responseMin, *responseMax, responseMedian,
+		xMean, yMean, std::sqrt(xVariance / count), std::sqrt(yVariance / count),
+		sizeSum / count};
+}
+
+std::vector<double> ImageProcessing::ExtractCaracteristics(const cv::Mat &image, size_t view)
+{
+	// The ORB view is described by its keypoints rather than by the drawn overlay
+	if (ImageProcessing::keyPointFeatures && view == ImageProcessing::ORBView)
+	{
+		return ImageProcessing::ExtractKeyPointCaracteristics(image);
+	}
+
+	std::vector<double> features = ImageProcessing::ExtractColorCaracteristics(image);
+	std::vector<double> texture = ImageProcessing::ExtractTextureCaracteristics(image);
+	features.insert(features.end(), texture.begin(), texture.end());
+
+	return features;
+}
@@ -0,0 +1,281 @@
+#include "image_reader.h"
+#include "pipeline.h"
+
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+namespace
+{
+	// One ring per thread, set up by its first read and torn down with the thread:
+	// the reader thread of ForEachBatch reuses it for every batch
+	struct Ring
+	{
+		struct io_uring ring;
+		bool ready = false;
+		bool unavailable = false; // Kernel without io_uring, or blocked by a seccomp filter
+
+		io_uring *Get()
+		{
+			if (!ready && !unavailable)
+			{
+				ready = io_uring_queue_init(ImageReader::QueueDepth, &ring, 0) == 0;
+				unavailable = !ready;
+			}
+			return ready ? &ring : nullptr;
+		}
+
+		~Ring()
+		{
+			if (ready)
+			{
+				io_uring_queue_exit(&ring);
+			}
+		}
+	};
+	thread_local Ring threadRing;
+}
+#endif
+
+std::vector<std::vector<uchar>> ImageReader::Read(const std::vector<std::string> &filePaths)
+{
+	// Buffers are sized from fstat before any read is issued, an empty path is left unread with an empty buffer
+	std::vector<int> fds(filePaths.size(), -1);
+	std::vector<std::vector<uchar>> buffers(filePaths.size());
+	auto closeAll = [&]()
+	{
+		for (const int fd : fds)
+		{
+			if (fd >= 0)
+			{
+				::close(fd);
+			}
+		}
+	};
+	for (size_t i = 0; i < filePaths.size(); i++)
+	{
+		if (filePaths[i].empty())
+		{
+			continue;
+		}
+		struct stat st;
+		fds[i] = ::open(filePaths[i].c_str(), O_RDONLY | O_CLOEXEC);
+		if (fds[i] < 0 || ::fstat(fds[i], &st) != 0)
+		{
+			closeAll();
+			throw std::runtime_error("Unable to open " + filePaths[i]);
+		}
+		buffers[i].resize(st.st_size);
+	}
+	try
+	{
+		if (!ImageReader::ReadUring(filePaths, fds, buffers))
+		{
+			ImageReader::ReadPrefetched(filePaths, fds, buffers);
+		}
+	}
+	catch (...)
+	{
+		closeAll();
+		throw;
+	}
+	closeAll();
+	return buffers;
+}
+
+void ImageReader::ForEachBatch(const std::vector<std::string> &filePaths, size_t batchSize, const std::function<void(size_t first, std::vector<std::vector<uchar>> &buffers)> &process)
+{
+	// The next batch is read on its own thread while the current one is processed
+	BoundedQueue<std::pair<size_t, std::vector<std::vector<uchar>>>> batches(1);
+	std::exception_ptr error;
+	std::thread reader([&]()
+					   {
+		try {
+			for (size_t first = 0; first < filePaths.size(); first += batchSize) {
+				const std::vector<std::string> batch(filePaths.begin() + first, filePaths.begin() + std::min(first + batchSize, filePaths.size()));
+				if (!batches.Push({first, ImageReader::Read(batch)})) {
+					break;
+				}
+			}
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+		batches.Close(); });
+	try
+	{
+		std::pair<size_t, std::vector<std::vector<uchar>>> batch;
+		while (batches.Pop(batch))
+		{
+			process(batch.first, batch.second);
+		}
+	}
+	catch (...)
+	{
+		batches.Close();
+		reader.join();
+		throw;
+	}
+	reader.join();
+	if (error)
+	{
+		std::rethrow_exception(error);
+	}
+}
+
+bool ImageReader::ReadUring(const std::vector<std::string> &filePaths, const std::vector<int> &fds, std::vector<std::vector<uchar>> &buffers)
+{
+#ifdef HAVE_LIBURING
+	io_uring *ring = threadRing.Get();
+	if (ring == nullptr)
+	{
+		return false;
+	}
+	std::deque<size_t> pending;
+	for (size_t i = 0; i < buffers.size(); i++)
+	{
+		if (!buffers[i].empty())
+		{
+			pending.push_back(i);
+		}
+	}
+	std::vector<size_t> done(buffers.size(), 0);
+	std::string failed;
+	size_t inFlight = 0;
+	int ringError = 0;
+	while (inFlight > 0 || (!pending.empty() && failed.empty()))
+	{
+		// Fill the submission queue, short reads are queued again for their remainder
+		while (!pending.empty() && failed.empty() && inFlight < ImageReader::QueueDepth)
+		{
+			const size_t i = pending.front();
+			io_uring_sqe *sqe = io_uring_get_sqe(ring);
+			if (sqe == nullptr)
+			{
+				break;
+			}
+			pending.pop_front();
+			io_uring_prep_read(sqe, fds[i], buffers[i].data() + done[i], buffers[i].size() - done[i], done[i]);
+			io_uring_sqe_set_data(sqe, reinterpret_cast<void *>(i));
+			inFlight++;
+		}
+
+		// Submit, then reap every completion available, waiting for at least one
+		const int waited = io_uring_submit_and_wait(ring, 1);
+		if (waited == -EINTR || waited == -EAGAIN)
+		{
+			continue;
+		}
+		io_uring_cqe *cqe;
+		if (waited < 0 || io_uring_peek_cqe(ring, &cqe) != 0)
+		{
+			ringError = waited < 0 ? -waited : EIO;
+			break;
+		}
+		do
+		{
+			const size_t i = reinterpret_cast<size_t>(io_uring_cqe_get_data(cqe));
+			const int result = cqe->res;
+			io_uring_cqe_seen(ring, cqe);
+			inFlight--;
+			if (result == -EINTR || result == -EAGAIN)
+			{
+				pending.push_back(i);
+			}
+			else if (result <= 0)
+			{
+				failed = failed.empty() ? filePaths[i] : failed;
+			}
+			else if ((done[i] += result) < buffers[i].size())
+			{
+				pending.push_back(i);
+			}
+		} while (inFlight > 0 && io_uring_peek_cqe(ring, &cqe) == 0);
+	}
+	if (ringError != 0)
+	{
+		// The kernel may still write into the buffers of the reads it accepted, they complete before anything is released
+		size_t accepted = inFlight - io_uring_sq_ready(ring);
+		while (accepted > 0)
+		{
+			io_uring_cqe *cqe;
+			const int waited = io_uring_wait_cqe(ring, &cqe);
+			if (waited == -EINTR)
+			{
+				continue;
+			}
+			if (waited < 0)
+			{
+				break;
+			}
+			io_uring_cqe_seen(ring, cqe);
+			accepted--;
+		}
+		if (accepted > 0)
+		{
+			// Not drained: the ring and the buffers are left to the kernel on purpose, the batch is read into new buffers
+			for (auto &buffer : buffers)
+			{
+				const size_t size = buffer.size();
+				static_cast<void>(new std::vector<uchar>(std::move(buffer)));
+				buffer = std::vector<uchar>(size);
+			}
+		}
+		else
+		{
+			// Unsubmitted entries are dropped with the ring
+			io_uring_queue_exit(ring);
+		}
+		// Later reads of this thread use pread
+		threadRing.ready = false;
+		threadRing.unavailable = true;
+		std::cerr << "io_uring: " << std::strerror(ringError) << ", reading with pread" << std::endl;
+		return false;
+	}
+	if (!failed.empty())
+	{
+		throw std::runtime_error("Unable to read " + failed);
+	}
+	return true;
+#else
+	(void)filePaths;
+	(void)fds;
+	(void)buffers;
+	return false;
+#endif
+}
+
+void ImageReader::ReadPrefetched(const std::vector<std::string> &filePaths, const std::vector<int> &fds, std::vector<std::vector<uchar>> &buffers)
+{
+	// Readahead of the whole batch starts before the first blocking read
+	for (size_t i = 0; i < fds.size(); i++)
+	{
+		if (fds[i] >= 0)
+		{
+			::posix_fadvise(fds[i], 0, 0, POSIX_FADV_WILLNEED);
+		}
+	}
+	for (size_t i = 0; i < fds.size(); i++)
+	{
+		size_t done = 0;
+		while (done < buffers[i].size())
+		{
+			const ssize_t result = ::pread(fds[i], buffers[i].data() + done, buffers[i].size() - done, done);
+			if (result < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (result <= 0)
+			{
+				throw std::runtime_error("Unable to read " + filePaths[i]);
+			}
+			done += result;
+		}
+	}
+}
@@ -0,0 +1,168 @@
+#include "image_store.h"
+
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const uchar *ImageStore::mapping = nullptr;
+size_t ImageStore::mappingSize = 0;
+cv::Size ImageStore::imageSize;
+std::unordered_map<std::string, const ImageStore::Entry *> ImageStore::index;
+
+std::string ImageStore::Key(const std::string &imagePath)
+{
+	return std::filesystem::path(imagePath).lexically_normal().generic_string();
+}
+
+void ImageStore::Stat(const std::string &imagePath, int64_t &size, int64_t &mtime)
+{
+	std::error_code error;
+	size = std::filesystem::file_size(imagePath, error);
+	mtime = std::filesystem::last_write_time(imagePath, error).time_since_epoch().count();
+	if (error)
+	{
+		size = -1;
+		mtime = -1;
+	}
+}
+
+void ImageStore::Build(const std::string &storePath, const std::vector<std::string> &imagePaths, cv::Size size)
+{
+	// Header, index and paths, then one fixed-size slot per image
+	const size_t slotSize = static_cast<size_t>(size.width) * size.height * 3;
+	std::vector<Entry> entries(imagePaths.size());
+	std::string paths;
+	for (size_t i = 0; i < imagePaths.size(); i++)
+	{
+		const std::string key = ImageStore::Key(imagePaths[i]);
+		entries[i].pathOffset = paths.size();
+		entries[i].pathLength = key.size();
+		entries[i].valid = 0;
+		paths += key;
+	}
+	const size_t indexOffset = sizeof(Header);
+	const size_t pathsOffset = indexOffset + entries.size() * sizeof(Entry);
+	const size_t dataOffset = (pathsOffset + paths.size() + 4095) / 4096 * 4096;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		entries[i].offset = dataOffset + i * slotSize;
+	}
+
+	const std::string temporaryPath = storePath + ".tmp";
+	const int fd = ::open(temporaryPath.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0 || ::ftruncate(fd, dataOffset + entries.size() * slotSize) != 0)
+	{
+		throw std::runtime_error("Unable to create " + temporaryPath);
+	}
+
+	// Decode in parallel, each image goes to its own slot
+	cv::parallel_for_(cv::Range(0, imagePaths.size()), [&](const cv::Range &range)
+					  {
+		for (int i = range.start; i < range.end; i++) {
+			cv::Mat image = cv::imread(imagePaths[i], cv::IMREAD_COLOR);
+			if (image.empty()) {
+				continue;
+			}
+			if (image.size() != size) {
+				cv::resize(image, image, size, 0, 0, cv::INTER_AREA);
+			}
+			if (!image.isContinuous()) {
+				image = image.clone();
+			}
+			if (::pwrite(fd, image.data, slotSize, entries[i].offset) == static_cast<ssize_t>(slotSize)) {
+				ImageStore::Stat(imagePaths[i], entries[i].size, entries[i].mtime);
+				entries[i].valid = 1;
+			}
+		} });
+
+	Header header = {{'L', 'F', 'S', 'T'}, 1, entries.size(), size.height, size.width, dataOffset};
+	const bool written =
+		::pwrite(fd, &header, sizeof(Header), 0) == sizeof(Header) &&
+		::pwrite(fd, entries.data(), entries.size() * sizeof(Entry), indexOffset) == static_cast<ssize_t>(entries.size() * sizeof(Entry)) &&
+		::pwrite(fd, paths.data(), paths.size(), pathsOffset) == static_cast<ssize_t>(paths.size());
+	::close(fd);
+	if (!written)
+	{
+		throw std::runtime_error("Unable to write " + temporaryPath);
+	}
+	std::filesystem::rename(temporaryPath, storePath);
+}
+
+void ImageStore::Open(const std::string &storePath)
+{
+	ImageStore::Close();
+	const int fd = ::open(storePath.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || ::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header))
+	{
+		if (fd >= 0)
+		{
+			::close(fd);
+		}
+		throw std::runtime_error("Unable to open " + storePath);
+	}
+	// Read-only mapping: every process and thread reads the same page-cache pages
+	void *address = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (address == MAP_FAILED)
+	{
+		throw std::runtime_error("Unable to map " + storePath);
+	}
+	ImageStore::mapping = static_cast<const uchar *>(address);
+	ImageStore::mappingSize = st.st_size;
+
+	const Header *header = reinterpret_cast<const Header *>(ImageStore::mapping);
+	const size_t pathsOffset = sizeof(Header) + header->count * sizeof(Entry);
+	if (std::string(header->magic, 4) != "LFST" || header->version != 1 || pathsOffset > ImageStore::mappingSize)
+	{
+		ImageStore::Close();
+		throw std::runtime_error("Invalid image store " + storePath);
+	}
+	ImageStore::imageSize = cv::Size(header->cols, header->rows);
+	const size_t slotSize = static_cast<size_t>(header->cols) * header->rows * 3;
+	const Entry *entries = reinterpret_cast<const Entry *>(ImageStore::mapping + sizeof(Header));
+	const char *paths = reinterpret_cast<const char *>(ImageStore::mapping + pathsOffset);
+	for (uint64_t i = 0; i < header->count; i++)
+	{
+		if (entries[i].valid && entries[i].offset + slotSize <= ImageStore::mappingSize)
+		{
+			ImageStore::index[std::string(paths + entries[i].pathOffset, entries[i].pathLength)] = &entries[i];
+		}
+	}
+	::madvise(const_cast<uchar *>(ImageStore::mapping), ImageStore::mappingSize, MADV_WILLNEED);
+}
+
+void ImageStore::Close()
+{
+	if (ImageStore::mapping != nullptr)
+	{
+		::munmap(const_cast<uchar *>(ImageStore::mapping), ImageStore::mappingSize);
+	}
+	ImageStore::mapping = nullptr;
+	ImageStore::mappingSize = 0;
+	ImageStore::index.clear();
+}
+
+cv::Mat ImageStore::Get(const std::string &imagePath, int flags)
+{
+	// Entries are 3-channel BGR images, other reads decode the file
+	if (ImageStore::index.empty() || flags != cv::IMREAD_COLOR)
+	{
+		return cv::Mat();
+	}
+	const auto found = ImageStore::index.find(ImageStore::Key(imagePath));
+	if (found == ImageStore::index.end())
+	{
+		return cv::Mat();
+	}
+	// Stale entries fall back to decoding the file
+	int64_t size, mtime;
+	ImageStore::Stat(imagePath, size, mtime);
+	if (size != found->second->size || mtime != found->second->mtime)
+	{
+		return cv::Mat();
+	}
+	return cv::Mat(ImageStore::imageSize, CV_8UC3, const_cast<uchar *>(ImageStore::mapping + found->second->offset));
+}
@@ -1,11 +1,37 @@
 #include "image_utils.h"
 #include "image_processing.h"
+#include "image_pack.h"
+#include "image_store.h"
+#include "dataset_manifest.h"
+#include "image_dependencies.h"
+#include "image_reader.h"
+#include "feature_cache.h"
+#include "pipeline.h"
 
 #include <filesystem>
 
 std::mutex ImageUtils::mutex;
 int ImageUtils::progress;
 int ImageUtils::numComplete;
+bool ImageUtils::packed = false;
+ImageCodec::Format ImageUtils::format = ImageCodec::Format::Qoi;
+
+bool ImageUtils::IsGeneratedImage(const std::filesystem::path &path)
+{
+	const std::string extension = path.extension().string();
+	return path.filename().string().find('_') != std::string::npos && (ImageCodec::IsImageExtension(extension) || extension == ImagePack::Extension);
+}
+
+cv::Mat ImageUtils::ReadImage(const std::string &filePath, int flags)
+{
+	// Decoded copy from the image store when it is open, up to date and holds the requested layout
+	cv::Mat image = ImageStore::Get(filePath, flags);
+	if (!image.empty())
+	{
+		return image;
+	}
+	return ImageCodec::Read(filePath, flags);
+}
 
 void ImageUtils::ShowMosaic(const std::vector<cv::Mat> &images, const std::string &name, const std::vector<std::string> &targets)
 {
@@ -32,35 +58,57 @@ void ImageUtils::ShowMosaic(const std::vector<cv::Mat> &images, const std::strin
 	cv::imshow(name, mosaic);
 }
 
-void ImageUtils::SaveImages(const std::string &filePath, const std::vector<cv::Mat> &images, const std::vector<std::string> &types)
+std::vector<std::string> ImageUtils::SaveImages(const std::string &filePath, const std::vector<cv::Mat> &images, const std::vector<std::string> &types)
 {
 	const size_t lastSlashPos = filePath.find_last_of('/');
 	const size_t lastPointPos = filePath.find_last_of('.');
 	const std::string saveDir = filePath.substr(0, lastSlashPos + 1);
 	const std::string imgName = filePath.substr(lastSlashPos + 1, lastPointPos - lastSlashPos - 1);
 
+	std::vector<std::string> outputNames;
 	for (size_t i = 0; i < images.size(); i++)
 	{
-		const std::string outputFilename = saveDir + imgName + "_" + types[i] + ".JPG";
-		cv::imwrite(outputFilename, images[i]);
+		outputNames.push_back(imgName + "_" + types[i] + ImageCodec::Extension(ImageUtils::format));
+		const std::string outputFilename = saveDir + outputNames.back();
+		ImageCodec::Write(outputFilename, images[i], ImageUtils::format);
 		{
 			std::lock_guard<std::mutex> lock(ImageUtils::mutex);
 			std::cout << "\r\033[K"
 					  << "Saved : " << outputFilename << std::flush;
 		}
 	}
+	return outputNames;
+}
+
+std::string ImageUtils::SavePack(const std::string &filePath, const std::vector<cv::Mat> &images, const std::vector<std::string> &types, const std::string &suffix, const std::vector<std::vector<uchar>> &payloads)
+{
+	const size_t lastSlashPos = filePath.find_last_of('/');
+	const size_t lastPointPos = filePath.find_last_of('.');
+	const std::string saveDir = filePath.substr(0, lastSlashPos + 1);
+	const std::string imgName = filePath.substr(lastSlashPos + 1, lastPointPos - lastSlashPos - 1);
+
+	const std::string outputName = imgName + "_" + suffix + ImagePack::Extension;
+	ImagePack::Save(saveDir + outputName, images, std::vector<std::string>(types.begin(), types.begin() + images.size()), ImageUtils::format, payloads);
+	{
+		std::lock_guard<std::mutex> lock(ImageUtils::mutex);
+		std::cout << "\r\033[K"
+				  << "Saved : " << saveDir + outputName << std::flush;
+	}
+	return outputName;
 }
 
-std::vector<std::string> ImageUtils::GetImagesInDirectory(const std::string &directoryPath, int generation)
+std::vector<std::string> ImageUtils::GetImagesInDirectory(const std::string &directoryPath, int generation, const std::string &extension)
 {
 	std::vector<std::string> images;
 
-	for (const auto &entry : std::filesystem::directory_iterator(directoryPath))
+	// Records come sorted by sample number from the manifest
+	for (const auto &record : DatasetManifest::GetRecords(directoryPath))
 	{
-		if (entry.is_regular_file() && entry.path().extension() == ".JPG")
+		// Any image format when no extension is given
+		const std::string recordExtension = std::filesystem::path(record.name).extension().string();
+		if (extension.empty() ? ImageCodec::IsImageExtension(recordExtension) : recordExtension == extension)
 		{
-			std::string fileName = entry.path().filename().generic_string();
-			images.push_back(fileName);
+			images.push_back(record.name);
 			if (--generation == 0)
 			{
 				break;
@@ -68,19 +116,62 @@ std::vector<std::string> ImageUtils::GetImagesInDirectory(const std::string &dir
 		}
 	}
 
-	std::sort(images.begin(), images.end(), [](const std::string &a, const std::string &b)
-			  {
-		size_t posA = a.find(')');
-		size_t posB = b.find(')');
-		std::string numeroA = a.substr(a.find('(') + 1, posA - a.find('(') - 1);
-		std::string numeroB = b.substr(b.find('(') + 1, posB - b.find('(') - 1);
-		int intA = std::stoi(numeroA);
-		int intB = std::stoi(numeroB);
-		return intA < intB; });
-
 	return images;
 }
 
+namespace
+{
+	// A sample travelling through the directory pipelines
+	struct PipelineSample
+	{
+		std::string input; // File the sample was read from
+		std::string name;
+		cv::Mat image;
+		size_t count;
+		std::vector<cv::Mat> images;
+		std::vector<std::string> types;
+		uint64_t contentHash = 0; // Of the input file, 0 when read from a pack or the image store
+		cv::Mat leafMask = cv::Mat(); // Cached mask inside the leaf box, the image then only holds that box
+		cv::Size size = cv::Size();
+		std::vector<uchar> encoded = std::vector<uchar>(); // Bytes the image was decoded from, stored unchanged in a pack
+	};
+
+	size_t ComputeThreads()
+	{
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	void DisplayProgress(int increment)
+	{
+		std::lock_guard<std::mutex> lock(ImageUtils::mutex);
+		int progress = std::min(100, ((ImageUtils::progress += increment) * 100) / std::max(1, ImageUtils::numComplete));
+		int numComplete = (progress * 50) / 100;
+		int numRemaining = 50 - numComplete;
+		std::cout << "\n"
+				  << "[" << std::string(numComplete, '=') << std::string(numRemaining, ' ') << "] " << std::setw(3) << progress << "%" << std::flush;
+		std::cout << "\033[A";
+	}
+
+	uint64_t StageHash(char stage)
+	{
+		// Settings that shape the generated images of a stage, bump the version when an algorithm changes
+		std::string settings = std::string(1, stage) + "/1/" + ImageCodec::Name(ImageUtils::format) + "/" + std::to_string(ImageUtils::packed);
+		if (stage == 'T')
+		{
+			settings += "/" + std::to_string(ImageProcessing::keyPointFeatures) + "/" + std::to_string(ImageProcessing::orbFeatures) +
+						"/" + std::to_string(static_cast<int>(ImageProcessing::segmentation)) + "/" + std::to_string(ImageProcessing::segmentationScale);
+		}
+		return ImageDependencies::Hash(settings);
+	}
+
+	void SkipProgress(int skipped)
+	{
+		// Up to date samples are not part of the work left
+		std::lock_guard<std::mutex> lock(ImageUtils::mutex);
+		ImageUtils::numComplete -= skipped;
+	}
+}
+
 void ImageUtils::SaveTFromToDirectory(const std::string &source, const std::string &destination, int generation)
 {
 	// Check if source and destination are provided
@@ -89,47 +180,230 @@ void ImageUtils::SaveTFromToDirectory(const std::string &source, const std::stri
 		throw std::runtime_error("Missing source or destination directory.");
 	}
 
-	std::vector<std::string> names = ImageUtils::GetImagesInDirectory(source, generation);
+	// Source images, then augmented images and in packed mode the planes of augmentation packs
+	// from the destination. Transformations left by a previous run are outputs, not inputs.
+	std::vector<std::string> directories = {source};
+	if (std::filesystem::path(destination).lexically_normal() != std::filesystem::path(source).lexically_normal())
+	{
+		directories.push_back(destination);
+	}
+	std::vector<std::string> names, inputs, packNames, packInputs;
+	const std::string augmentationSuffix = "_A" + ImagePack::Extension;
+	for (const auto &directory : directories)
+	{
+		for (const auto &record : DatasetManifest::GetRecords(directory))
+		{
+			if (record.variantId != 0)
+			{
+				continue;
+			}
+			if (ImageCodec::IsImageExtension(std::filesystem::path(record.name).extension().string()))
+			{
+				if (static_cast<int>(names.size()) < generation)
+				{
+					names.push_back(record.name);
+					inputs.push_back(directory + record.name);
+				}
+			}
+			else if (ImageUtils::packed && record.name.ends_with(augmentationSuffix))
+			{
+				packNames.push_back(record.name);
+				packInputs.push_back(directory + record.name);
+			}
+		}
+	}
+	names.insert(names.end(), packNames.begin(), packNames.end());
+	inputs.insert(inputs.end(), packInputs.begin(), packInputs.end());
 
-	for (size_t i = 0; i < names.size(); i++)
+	// Samples to transform are chosen before any stage runs: an image counts as one, a pack
+	// as its planes, in input order until the generation count is reached
+	std::vector<size_t> counts;
+	for (size_t i = 0, selected = 0; i < names.size() && selected < static_cast<size_t>(std::max(0, generation)); i++)
 	{
+		const size_t planes = names[i].ends_with(ImagePack::Extension) ? ImagePack::Count(inputs[i]) : 1;
+		counts.push_back(std::min(planes, generation - selected));
+		selected += counts.back();
+	}
+	names.resize(counts.size());
+	inputs.resize(counts.size());
 
-		// Load image
-		cv::Mat originalImage = cv::imread(source + names[i]);
-		if (originalImage.empty())
+	// Samples whose input and settings did not change keep their transformations
+	const uint64_t stageHash = StageHash('T');
+	std::vector<uint64_t> configHashes;
+	for (const size_t count : counts)
+	{
+		configHashes.push_back(ImageDependencies::Hash(&count, sizeof(size_t), stageHash));
+	}
+	const std::vector<bool> outdated = ImageDependencies::Outdated(destination, inputs, 'T', configHashes);
+	std::vector<std::string> pendingNames, pendingInputs;
+	std::vector<size_t> pendingCounts;
+	int skipped = 0;
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		if (outdated[i])
 		{
-			throw std::runtime_error("Unable to load the image. " + source + names[i]);
+			pendingNames.push_back(names[i]);
+			pendingInputs.push_back(inputs[i]);
+			pendingCounts.push_back(counts[i]);
 		}
-
-		// Process images
-		std::vector<cv::Mat> images;
-		cv::Mat clone = originalImage.clone();
-		ImageProcessing::ExtractLeafAndRescale(clone);
-		for (int i = 0; i < 6; i++)
+		else
 		{
-			images.push_back(clone.clone());
+			skipped += counts[i];
 		}
-		cv::GaussianBlur(images[1], images[1], {5, 5}, 0);
-		ImageProcessing::EqualizeHistogramColor(images[2]);
-		ImageProcessing::DetectORBKeyPoints(images[3]);
-		ImageProcessing::EqualizeHistogramValue(images[4]);
-		ImageProcessing::EqualizeHistogramSaturation(images[5]);
-
-		// Save
-		std::vector<std::string> transformations = {"T1", "T2", "T3", "T4", "T5", "T6"};
-		ImageUtils::SaveImages(destination + names[i], images, transformations);
+	}
+	names.swap(pendingNames);
+	inputs.swap(pendingInputs);
+	counts.swap(pendingCounts);
+	SkipProgress(skipped);
 
+	// Files are read by windows, the next window while the current one goes through the decode, transform
+	// and encode stages. Sources found in the image store are not read
+	std::vector<cv::Mat> stored(names.size());
+	std::vector<std::string> readPaths(names.size());
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		if (!names[i].ends_with(ImagePack::Extension))
 		{
-			// Progression
-			std::lock_guard<std::mutex> lock(ImageUtils::mutex);
-			int progress = (++ImageUtils::progress) * 100 / ImageUtils::numComplete;
-			int numComplete = (progress * 50) / 100;
-			int numRemaining = 50 - numComplete;
-			std::cout << "\n"
-					  << "[" << std::string(numComplete, '=') << std::string(numRemaining, ' ') << "] " << std::setw(3) << progress << "%" << std::flush;
-			std::cout << "\033[A";
+			stored[i] = ImageStore::Get(inputs[i]);
+		}
+		if (stored[i].empty())
+		{
+			readPaths[i] = inputs[i];
 		}
 	}
+	const size_t threads = ComputeThreads();
+	const size_t windowSamples = 64;
+	ImageReader::ForEachBatch(readPaths, windowSamples, [&](size_t first, std::vector<std::vector<uchar>> &buffers)
+							  {
+		Pipeline::Run<std::vector<PipelineSample>, std::vector<PipelineSample>>(
+			buffers.size(), 2, threads, std::max<size_t>(1, threads / 4), 2 * threads,
+			[&](size_t window)
+			{
+				// Load image
+				const size_t i = first + window;
+				const std::vector<uchar> &buffer = buffers[window];
+				std::vector<PipelineSample> samples;
+				if (names[i].ends_with(ImagePack::Extension))
+				{
+					std::vector<std::string> planeNames;
+					std::vector<std::vector<uchar>> payloads;
+					std::vector<cv::Mat> planes = ImagePack::Decode(buffer.data(), buffer.size(), planeNames, inputs[i], &payloads);
+					const std::string stem = names[i].substr(0, names[i].length() - ImagePack::Extension.length() - 2);
+					for (size_t plane = 0; plane < std::min(planes.size(), counts[i]); plane++)
+					{
+						samples.push_back({inputs[i], stem + "_" + planeNames[plane] + ".JPG", planes[plane], counts[i], {}, {}});
+						samples.back().encoded = std::move(payloads[plane]);
+					}
+				}
+				else
+				{
+					PipelineSample sample = {inputs[i], names[i], stored[i], counts[i], {}, {}};
+					if (sample.image.empty())
+					{
+						// With a cached leaf mask only the leaf box is decoded, packs also keep the full original
+						sample.contentHash = ImageDependencies::Hash(buffer.data(), buffer.size());
+						cv::Rect box;
+						if (!ImageUtils::packed && FeatureCache::GetLeafMask(sample.contentHash, sample.size, box, sample.leafMask))
+						{
+							sample.image = ImageCodec::DecodeRegion(buffer.data(), buffer.size(), box);
+						}
+						if (sample.image.empty())
+						{
+							sample.leafMask.release();
+							sample.image = ImageCodec::Decode(buffer.data(), buffer.size());
+							if (ImageUtils::packed)
+							{
+								sample.encoded = buffer;
+							}
+						}
+					}
+					if (sample.image.empty())
+					{
+						throw std::runtime_error("Unable to load the image. " + inputs[i]);
+					}
+					samples.push_back(sample);
+				}
+				return samples;
+			},
+			[&](std::vector<PipelineSample> &samples)
+			{
+				for (auto &sample : samples)
+				{
+					// Process images
+					std::vector<cv::Mat> &images = sample.images;
+					cv::Mat clone;
+					if (!sample.leafMask.empty())
+					{
+						clone = ImageProcessing::RescaleLeafRegion(sample.image, sample.leafMask, sample.size);
+					}
+					else
+					{
+						const cv::Mat mask = ImageProcessing::ExtractLeafMask(sample.image);
+						const cv::Rect box = ImageProcessing::LeafBoundingBox(mask);
+						if (box.empty())
+						{
+							clone = cv::Mat::zeros(sample.image.size(), sample.image.type());
+						}
+						else
+						{
+							clone = ImageProcessing::RescaleLeafRegion(sample.image(box), mask(box), sample.image.size());
+							if (sample.contentHash != 0)
+							{
+								FeatureCache::PutLeafMask(sample.contentHash, sample.image.size(), box, mask(box));
+							}
+						}
+					}
+					for (int i = 0; i < 6; i++)
+					{
+						images.push_back(clone.clone());
+					}
+					cv::GaussianBlur(images[1], images[1], {5, 5}, 0);
+					ImageProcessing::EqualizeHistogramColor(images[2]);
+					ImageProcessing::EqualizeHistogramValue(images[4]);
+					ImageProcessing::EqualizeHistogramSaturation(images[5]);
+					sample.types = {"T1", "T2", "T3", "T4", "T5", "T6"};
+					if (ImageProcessing::keyPointFeatures)
+					{
+						// Keypoint statistics are extracted from T1, the ORB view is not needed
+						images.erase(images.begin() + 3);
+						sample.types.erase(sample.types.begin() + 3);
+					}
+					else
+					{
+						ImageProcessing::DetectORBKeyPoints(images[3]);
+					}
+				}
+				return std::move(samples);
+			},
+			[&](std::vector<PipelineSample> &samples)
+			{
+				std::vector<std::string> outputs;
+				for (auto &sample : samples)
+				{
+					// Save
+					if (ImageUtils::packed)
+					{
+						// The original is stored too, so a sample is read back from a single file.
+						// Its source bytes are kept as they are, a second lossy encode would change them
+						sample.images.insert(sample.images.begin(), sample.image);
+						sample.types.insert(sample.types.begin(), "Original");
+						outputs.push_back(ImageUtils::SavePack(destination + sample.name, sample.images, sample.types, "T", {sample.encoded}));
+					}
+					else
+					{
+						const std::vector<std::string> names = ImageUtils::SaveImages(destination + sample.name, sample.images, sample.types);
+						outputs.insert(outputs.end(), names.begin(), names.end());
+					}
+					// Progression
+					DisplayProgress(1);
+				}
+				if (!samples.empty())
+				{
+					ImageDependencies::Update(destination, samples[0].input, 'T', ImageDependencies::Hash(&samples[0].count, sizeof(size_t), stageHash), outputs);
+				}
+			}); });
+	ImageDependencies::Save(destination);
+	DatasetManifest::Invalidate(destination);
 }
 
 void ImageUtils::SaveAFromToDirectory(const std::string &source, const std::string &destination, int generation)
@@ -140,78 +414,112 @@ void ImageUtils::SaveAFromToDirectory(const std::string &source, const std::stri
 		throw std::runtime_error("Missing source or destination directory.");
 	}
 
-	int progress = 0;
-	std::vector<std::string> names = ImageUtils::GetImagesInDirectory(source, generation / 6 + 1);
-	for (size_t i = 0; i < names.size(); i++)
+	// Six augmentations per source image until the generation count is reached
+	std::vector<std::string> names;
+	for (const auto &record : DatasetManifest::GetRecords(source))
 	{
-
-		// Load an image from the specified file path
-		cv::Mat image = cv::imread(source + names[i]);
-		if (image.empty())
+		if (static_cast<int>(names.size()) > generation / 6)
 		{
-			throw std::runtime_error("Unable to load the image. " + source + names[i]);
+			break;
 		}
-		std::vector<cv::Mat> images;
+		if (!ImageUtils::IsGeneratedImage(record.name) && ImageCodec::IsImageExtension(std::filesystem::path(record.name).extension().string()))
+		{
+			names.push_back(record.name);
+		}
+	}
+	std::vector<size_t> counts;
+	for (int progress = 0; progress < generation && counts.size() < names.size(); progress += 6)
+	{
+		counts.push_back(std::min(6, generation - progress));
+	}
 
-		// Apply various image processing operations to different copies of the image
-		if (progress + 6 <= generation)
+	// Images whose source and settings did not change keep their augmentations
+	const uint64_t stageHash = StageHash('A');
+	std::vector<std::string> inputs;
+	std::vector<uint64_t> configHashes;
+	for (size_t i = 0; i < counts.size(); i++)
+	{
+		inputs.push_back(source + names[i]);
+		configHashes.push_back(ImageDependencies::Hash(&counts[i], sizeof(size_t), stageHash));
+	}
+	const std::vector<bool> outdated = ImageDependencies::Outdated(destination, inputs, 'A', configHashes);
+	std::vector<size_t> pending;
+	int skipped = 0;
+	for (size_t i = 0; i < counts.size(); i++)
+	{
+		if (outdated[i])
 		{
-			for (int i = 0; i < 6; i++)
-			{
-				images.push_back(image.clone());
-			}
-			ImageProcessing::Rotate(images[0], 5.0, 45.0);
-			ImageProcessing::Distort(images[1]);
-			ImageProcessing::Flip(images[2]);
-			ImageProcessing::Shear(images[3], 0.2, 0.3);
-			ImageProcessing::Scale(images[4], 0.5, 0.9);
-			ImageProcessing::Projective(images[5], 30, 40);
-			progress += 6;
+			pending.push_back(i);
 		}
 		else
 		{
-			if (progress == generation)
+			skipped += counts[i];
+		}
+	}
+	SkipProgress(skipped);
+
+	// Decode, augment and encode stages run concurrently
+	const size_t threads = ComputeThreads();
+	Pipeline::Run<PipelineSample, PipelineSample>(
+		pending.size(), 2, threads, std::max<size_t>(1, threads / 4), 2 * threads,
+		[&](size_t i)
+		{
+			// Load an image from the specified file path
+			const size_t index = pending[i];
+			cv::Mat image = ImageUtils::ReadImage(inputs[index]);
+			if (image.empty())
 			{
-				break;
+				throw std::runtime_error("Unable to load the image. " + inputs[index]);
 			}
-			size_t num = generation - progress;
-			for (size_t i = 0; i < num; i++)
+			return PipelineSample{inputs[index], names[index], image, counts[index], {}, {}};
+		},
+		[&](PipelineSample &sample)
+		{
+			// Apply various image processing operations to different copies of the image
+			std::vector<cv::Mat> &images = sample.images;
+			for (size_t i = 0; i < sample.count; i++)
 			{
-				images.push_back(image.clone());
+				images.push_back(sample.image.clone());
 			}
 			ImageProcessing::Rotate(images[0], 5.0, 45.0);
-			if (num > 1)
+			if (sample.count > 1)
 			{
 				ImageProcessing::Distort(images[1]);
 			}
-			if (num > 2)
+			if (sample.count > 2)
 			{
 				ImageProcessing::Flip(images[2]);
 			}
-			if (num > 3)
+			if (sample.count > 3)
 			{
 				ImageProcessing::Shear(images[3], 0.2, 0.3);
 			}
-			if (num > 4)
+			if (sample.count > 4)
 			{
 				ImageProcessing::Scale(images[4], 0.5, 0.9);
 			}
-			progress += num;
-		}
-
-		// Create a mosaic image from the processed images
-		std::vector<std::string> augmentations = {"Rotate", "Distort", "Flip", "Shear", "Scale", "Projective"};
-		ImageUtils::SaveImages(destination + names[i], images, augmentations);
-
-		// Progression
+			if (sample.count > 5)
+			{
+				ImageProcessing::Projective(images[5], 30, 40);
+			}
+			sample.types = {"Rotate", "Distort", "Flip", "Shear", "Scale", "Projective"};
+			return std::move(sample);
+		},
+		[&](PipelineSample &sample)
 		{
-			std::lock_guard<std::mutex> lock(ImageUtils::mutex);
-			int progress = ((ImageUtils::progress += 6) * 100) / ImageUtils::numComplete;
-			int numComplete = (progress * 50) / 100;
-			int numRemaining = 50 - numComplete;
-			std::cout << "\n"
-					  << "[" << std::string(numComplete, '=') << std::string(numRemaining, ' ') << "] " << std::setw(3) << progress << "%" << std::flush;
-			std::cout << "\033[A";
-		}
-	}
-}
\ No newline at end of file
+			std::vector<std::string> outputs;
+			if (ImageUtils::packed)
+			{
+				outputs.push_back(ImageUtils::SavePack(destination + sample.name, sample.images, sample.types, "A"));
+			}
+			else
+			{
+				outputs = ImageUtils::SaveImages(destination + sample.name, sample.images, sample.types);
+			}
+			ImageDependencies::Update(destination, sample.input, 'A', ImageDependencies::Hash(&sample.count, sizeof(size_t), stageHash), outputs);
+			// Progression
+			DisplayProgress(sample.images.size());
+		});
+	ImageDependencies::Save(destination);
+	DatasetManifest::Invalidate(destination);
+}
@@ -1,18 +1,40 @@
 #include "model_utils.h"
 #include "model_calculate.h"
+#include "vector_kernels.h"
 
 #include <iostream>
 #include <random>
 #include <iomanip>
+#include <limits>
 #include <opencv2/opencv.hpp>
-#include <unordered_set>
+#include <algorithm>
+
+ModelUtils::ModelType ModelCalculate::modelType = ModelUtils::ModelType::Sigmoid;
+ModelCalculate::Optimizer ModelCalculate::optimizer = ModelCalculate::Optimizer::Gradient;
+size_t ModelCalculate::epochs = 200;
+size_t ModelCalculate::batchSize = 0;
+double ModelCalculate::learningRate = 0.1;
+
+ModelCalculate::Optimizer ModelCalculate::ParseOptimizer(const std::string &name)
+{
+	const std::vector<std::pair<std::string, Optimizer>> optimizers = {
+		{"gd", Optimizer::Gradient}, {"momentum", Optimizer::Momentum}, {"adam", Optimizer::Adam}, {"adagrad", Optimizer::AdaGrad}};
+	for (const auto &[optimizerName, optimizer] : optimizers)
+	{
+		if (optimizerName == name)
+		{
+			return optimizer;
+		}
+	}
+	throw std::runtime_error("Unknown optimizer: " + name + " (gd, momentum, adam, adagrad)");
+}
 
 std::vector<double> ModelCalculate::Accuracy(
-	const std::vector<std::vector<double>> &inputs,
-	const std::vector<std::vector<double>> &targetsOneHot,
+	const FeatureMatrix &inputs,
+	const std::vector<size_t> &rows,
 	const std::vector<std::vector<double>> &weights)
 {
-	const size_t numEntries = inputs.size();
+	const size_t numEntries = rows.size();
 	const size_t numTargets = weights.size();
 
 	std::vector<double> classCount(numTargets, 0);
@@ -24,7 +46,7 @@ std::vector<double> ModelCalculate::Accuracy(
 		size_t predictedTarget = 0;
 		for (size_t j = 0; j < numTargets; ++j)
 		{
-			double probability = ModelCalculate::LogisticRegressionHypothesis(weights[j], inputs[i]);
+			double probability = ModelCalculate::LogisticRegressionHypothesis(weights[j], inputs.Row(rows[i]));
 			if (probability > maxProbability)
 			{
 				maxProbability = probability;
@@ -32,21 +54,12 @@ std::vector<double> ModelCalculate::Accuracy(
 			}
 		}
 		// for class
-		for (size_t j = 0; j < numTargets; ++j)
-		{
-			if (targetsOneHot[i][j] == 1)
-			{
-				classCount[j]++;
-				if (predictedTarget == j)
-				{
-					classPrediction[j]++;
-				}
-				break;
-			}
-		}
+		const size_t target = inputs.ClassId(rows[i]);
+		classCount[target]++;
 		// for all
-		if (targetsOneHot[i][predictedTarget] == 1.0)
+		if (predictedTarget == target)
 		{
+			classPrediction[target]++;
 			correctPredictions++;
 		}
 	}
@@ -59,84 +72,147 @@ std::vector<double> ModelCalculate::Accuracy(
 	return results;
 }
 
-double ModelCalculate::LossFunction(
-	const std::vector<std::vector<double>> &inputs,
-	const std::vector<std::vector<double>> &weights,
-	const std::vector<std::vector<double>> &targetsOneHot,
-	const size_t target)
-{
-	const size_t numEntries = inputs.size();
-	double loss = 0;
-	for (size_t i = 0; i < numEntries; ++i)
-	{
-		double proba = ModelCalculate::LogisticRegressionHypothesis(weights[target], inputs[i]);
-		loss += targetsOneHot[i][target] * std::log(proba + 2.2250738585072014e-308) +
-				(1.0 - targetsOneHot[i][target]) * std::log(1.0 - proba + 2.2250738585072014e-308);
-	}
-	return -(1.0 / numEntries) * loss;
-}
-
 double ModelCalculate::LogisticRegressionHypothesis(
-	const std::vector<double> &inputWeights,
-	const std::vector<double> &inputFeatures)
+	std::span<const double> inputWeights,
+	std::span<const double> inputFeatures)
 {
-	const size_t numFeatures = inputFeatures.size();
-	double weightedSum = 0;
-	for (size_t i = 0; i < numFeatures; ++i)
-	{
-		weightedSum += inputWeights[i] * inputFeatures[i];
-	}
+	const double weightedSum = VectorKernels::Dot(inputWeights.data(), inputFeatures.data(), inputFeatures.size());
 	double sigmoid = 1.0 / (1.0 + exp(-weightedSum));
 	return sigmoid;
 }
 
-double ModelCalculate::LossFunctionPartialDerivative(
-	const std::vector<std::vector<double>> &inputs,
+std::vector<double> ModelCalculate::GradientDescent(
+	const FeatureMatrix &inputs,
+	std::span<const size_t> rows,
 	std::vector<std::vector<double>> &weights,
-	const std::vector<std::vector<double>> &targetsOneHot,
-	const size_t target,
-	const size_t j)
+	OptimizerState &state)
 {
-	const size_t numEntries = inputs.size();
-	double derivative = 0;
-	for (size_t i = 0; i < numEntries; i++)
+	const size_t numTargets = weights.size();
+	const size_t numFeatures = inputs.Cols();
+	// One pass over the rows for every target: each row is multiplied by all the weights while it is in cache,
+	// giving X W^T, and its residuals are accumulated into (P - Y)^T X. Chunks of rows run in parallel
+	const size_t numChunks = std::max<size_t>(1, std::min<size_t>(cv::getNumThreads() * 4, rows.size() / 64));
+	std::vector<double> gradients(numChunks * numTargets * numFeatures, 0.0);
+	std::vector<double> losses(numChunks * numTargets, 0.0);
+	cv::parallel_for_(cv::Range(0, numChunks), [&](const cv::Range &range)
+					  {
+		for (int chunk = range.start; chunk < range.end; chunk++) {
+			double *gradient = gradients.data() + chunk * numTargets * numFeatures;
+			double *loss = losses.data() + chunk * numTargets;
+			std::vector<double> probas(numTargets);
+			for (size_t i = rows.size() * chunk / numChunks; i < rows.size() * (chunk + 1) / numChunks; i++) {
+				const auto features = inputs.Row(rows[i]);
+				const size_t classId = inputs.ClassId(rows[i]);
+				double maxScore = -std::numeric_limits<double>::infinity();
+				for (size_t target = 0; target < numTargets; target++) {
+					probas[target] = VectorKernels::Dot(weights[target].data(), features.data(), numFeatures);
+					maxScore = std::max(maxScore, probas[target]);
+				}
+				if (ModelCalculate::modelType == ModelUtils::ModelType::Softmax) {
+					// Cross-entropy of the softmax, shifted by the highest score, each target holds the loss of its rows
+					double sum = 0.0;
+					for (size_t target = 0; target < numTargets; target++) {
+						probas[target] = std::exp(probas[target] - maxScore);
+						sum += probas[target];
+					}
+					for (size_t target = 0; target < numTargets; target++) {
+						probas[target] /= sum;
+					}
+					loss[classId] += std::log(probas[classId] + 2.2250738585072014e-308);
+				}
+				else {
+					for (size_t target = 0; target < numTargets; target++) {
+						probas[target] = 1.0 / (1.0 + std::exp(-probas[target]));
+						const double oneHot = classId == target ? 1.0 : 0.0;
+						loss[target] += oneHot * std::log(probas[target] + 2.2250738585072014e-308) +
+										(1.0 - oneHot) * std::log(1.0 - probas[target] + 2.2250738585072014e-308);
+					}
+				}
+				for (size_t target = 0; target < numTargets; target++) {
+					VectorKernels::Axpy(probas[target] - (classId == target ? 1.0 : 0.0), features.data(), gradient + target * numFeatures, numFeatures);
+				}
+			}
+		} });
+
+	// Chunks are merged in order into the mean gradient of the rows, then every target is updated
+	std::vector<double> targetLosses(numTargets, 0.0);
+	for (size_t chunk = 1; chunk < numChunks; chunk++)
+	{
+		VectorKernels::Axpy(1.0, gradients.data() + chunk * numTargets * numFeatures, gradients.data(), numTargets * numFeatures);
+	}
+	gradients.resize(numTargets * numFeatures);
+	for (double &gradient : gradients)
 	{
-		double proba = ModelCalculate::LogisticRegressionHypothesis(weights[target], inputs[i]);
-		derivative += (proba - targetsOneHot[i][target]) * inputs[i][j];
+		gradient /= rows.size();
+	}
+	for (size_t target = 0; target < numTargets; target++)
+	{
+		for (size_t chunk = 0; chunk < numChunks; chunk++)
+		{
+			targetLosses[target] += losses[chunk * numTargets + target];
+		}
+		targetLosses[target] *= -(1.0 / rows.size());
 	}
-	return (1.0 / numEntries) * derivative;
+	ModelCalculate::UpdateWeights(weights, gradients, state);
+	// Loss of the weights the step started from
+	return targetLosses;
 }
 
-void ModelCalculate::GradientDescent(
-	const std::vector<std::vector<double>> &inputs,
+void ModelCalculate::UpdateWeights(
 	std::vector<std::vector<double>> &weights,
-	const std::vector<std::vector<double>> &targetsOneHot,
-	const size_t target)
+	const std::vector<double> &gradient,
+	OptimizerState &state)
 {
-	const double learningRate = 0.1;
-	const size_t numFeatures = inputs[0].size();
-	std::vector<std::vector<double>> tmp_weights = weights;
-	tmp_weights[target][0] = weights[target][0];
-	for (size_t j = 0; j < numFeatures; j++)
+	const double momentum = 0.9;
+	const double beta1 = 0.9;
+	const double beta2 = 0.999;
+	const double epsilon = 1e-8;
+	if (state.steps++ == 0)
 	{
-		double derivative = ModelCalculate::LossFunctionPartialDerivative(inputs, weights, targetsOneHot, target, j);
-
-		tmp_weights[target][j] -= learningRate * derivative;
+		state.velocity.assign(gradient.size(), 0.0);
+		state.squares.assign(gradient.size(), 0.0);
+	}
+	// Adam moments are corrected for their zero start
+	const double firstCorrection = 1.0 - std::pow(beta1, state.steps);
+	const double secondCorrection = 1.0 - std::pow(beta2, state.steps);
+	const size_t numFeatures = gradient.size() / weights.size();
+	for (size_t target = 0; target < weights.size(); target++)
+	{
+		for (size_t j = 0; j < numFeatures; j++)
+		{
+			const size_t k = target * numFeatures + j;
+			double step = gradient[k];
+			switch (ModelCalculate::optimizer)
+			{
+			case Optimizer::Momentum:
+				state.velocity[k] = momentum * state.velocity[k] + gradient[k];
+				step = state.velocity[k];
+				break;
+			case Optimizer::Adam:
+				state.velocity[k] = beta1 * state.velocity[k] + (1.0 - beta1) * gradient[k];
+				state.squares[k] = beta2 * state.squares[k] + (1.0 - beta2) * gradient[k] * gradient[k];
+				step = (state.velocity[k] / firstCorrection) / (std::sqrt(state.squares[k] / secondCorrection) + epsilon);
+				break;
+			case Optimizer::AdaGrad:
+				state.squares[k] += gradient[k] * gradient[k];
+				step = gradient[k] / (std::sqrt(state.squares[k]) + epsilon);
+				break;
+			case Optimizer::Gradient:
+				break;
+			}
+			weights[target][j] -= ModelCalculate::learningRate * step;
+		}
 	}
-	// Update weights after calculating all partial derivatives
-	weights[target] = std::move(tmp_weights[target]);
 }
 
 void ModelCalculate::LogisticRegressionTargetsOneHotTraining(
 	std::vector<std::vector<double>> &weights,
-	const std::vector<std::vector<double>> &trainInputs,
-	const std::vector<std::vector<double>> &validInputs,
-	const std::vector<std::vector<double>> &trainTargetsOneHot,
-	const std::vector<std::vector<double>> &validTargetsOneHot,
+	const FeatureMatrix &inputs,
+	const std::vector<size_t> &trainRows,
+	const std::vector<size_t> &validRows,
 	const size_t epochs)
 {
 	const size_t numTargets = weights.size();
-	const std::vector<int> targetIndices = {0, 1, 2, 3, 4, 5, 6, 7};
 	// Header
 	std::cout << std::left << std::setw(std::to_string(epochs).length() + 8) << "Epochs";
 	for (size_t counter = 1; counter <= numTargets; counter++)
@@ -144,26 +220,38 @@ void ModelCalculate::LogisticRegressionTargetsOneHotTraining(
 		std::cout << std::setw(10) << "Target " + std::to_string(counter);
 	}
 	std::cout << std::endl;
+	// Mini-batches are index ranges of a permutation of the training rows, the rows stay in the matrix
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::vector<size_t> order = trainRows;
+	const size_t batchSize = ModelCalculate::batchSize > 0 ? std::min(ModelCalculate::batchSize, order.size()) : order.size();
+	OptimizerState state;
 	// Training
 	for (size_t epoch = 0; epoch < epochs; ++epoch)
 	{
-
-		cv::parallel_for_(cv::Range(0, numTargets), [&](const cv::Range &range)
-						  {
-			for (int target = range.start; target < range.end; target++) {
-				ModelCalculate::GradientDescent(trainInputs, weights, trainTargetsOneHot, target);
-			} });
+		// A new permutation every epoch, full-batch steps keep the row order
+		if (batchSize < order.size())
+		{
+			std::shuffle(order.begin(), order.end(), gen);
+		}
+		// All targets in a single pass over the rows of each batch
+		std::vector<double> losses(numTargets, 0.0);
+		for (size_t first = 0; first < order.size(); first += batchSize)
+		{
+			const std::span<const size_t> batch(order.data() + first, std::min(batchSize, order.size() - first));
+			const std::vector<double> batchLosses = ModelCalculate::GradientDescent(inputs, batch, weights, state);
+			VectorKernels::Axpy(static_cast<double>(batch.size()) / order.size(), batchLosses.data(), losses.data(), numTargets);
+		}
 
 		// Loss
 		std::cout << "Epoch " << std::left << std::setw(std::to_string(epochs).length() + 2) << epoch + 1;
-		for (size_t target = 0; target < numTargets; target++)
+		for (const double loss : losses)
 		{
-			double loss = ModelCalculate::LossFunction(trainInputs, weights, trainTargetsOneHot, target);
 			std::cout << std::setw(10) << std::setprecision(6) << loss;
 		}
 		std::cout << std::endl;
 		std::cout << std::left << std::setw(std::to_string(epochs).length() + 8) << "Accuracy" << std::setw(10);
-		std::vector<double> accuracy = ModelCalculate::Accuracy(validInputs, validTargetsOneHot, weights);
+		std::vector<double> accuracy = ModelCalculate::Accuracy(inputs, validRows, weights);
 		for (const auto value : accuracy)
 		{
 			std::cout << std::setw(10) << (std::ostringstream() << std::fixed << std::setprecision(2) << value << '%').str();
@@ -173,7 +261,8 @@ void ModelCalculate::LogisticRegressionTargetsOneHotTraining(
 }
 
 void ModelCalculate::GenerateModels(
-	std::vector<DataEntry> &database,
+	FeatureMatrix &database,
+	const FeatureStats &stats,
 	std::vector<std::vector<double>> &weightsAfterTraining,
 	std::vector<double> &featureMeans,
 	std::vector<double> &featureStdDevs)
@@ -181,50 +270,51 @@ void ModelCalculate::GenerateModels(
 	std::cout << "\r\033[K"
 			  << "Models training..." << std::endl;
 
-	auto featuresBeforeFilter = database[0].features.size();
-	ModelUtils::NormalizationZScore(database, featureMeans, featureStdDevs);
-	int featuresAfterFilter = database[0].features.size();
+	auto featuresBeforeFilter = database.Cols();
+	ModelUtils::NormalizationZScore(database, stats, featureMeans, featureStdDevs);
+	int featuresAfterFilter = database.Cols();
 	int featuresRemoved = featuresBeforeFilter - featuresAfterFilter;
 	std::cout << "Number of features after filtering: " << featuresAfterFilter << " (" << featuresRemoved << " has been removed)" << std::endl;
 
-	std::vector<std::vector<double>> weights(ModelUtils::targets.size(), std::vector<double>(database[0].features.size(), 0.0));
-	std::vector<std::vector<double>> trainInputs, trainTargetsOneHot, validInputs, validTargetsOneHot;
-	ModelUtils::SetupTrainingData(database, weights, trainInputs, trainTargetsOneHot);
+	std::vector<std::vector<double>> weights(ModelUtils::targets.size(), std::vector<double>(database.Cols(), 0.0));
+	ModelUtils::SetupTrainingData(database, weights);
 
-	std::cout << "Inputs : " << trainInputs.size() << std::endl;
+	std::cout << "Inputs : " << database.Rows() << std::endl;
 	std::random_device rd;
 	std::mt19937 gen(rd());
-	const size_t numTargets = trainInputs.size() / 8;
-	const size_t forValidation = numTargets / 5;
-	std::unordered_set<int> selectedIndices;
-	for (int c = 1; c <= 8; c++)
+	// Validation takes a fifth of every class, drawn from the rows of that class wherever they are:
+	// classes are not equal blocks once a sample is skipped or shards are merged
+	std::vector<std::vector<size_t>> classRows(ModelUtils::targets.size());
+	for (size_t i = 0; i < database.Rows(); ++i)
+	{
+		classRows[database.ClassId(i)].push_back(i);
+	}
+	std::vector<bool> selected(database.Rows(), false);
+	for (auto &rows : classRows)
 	{
-		while (selectedIndices.size() < forValidation * c)
+		std::shuffle(rows.begin(), rows.end(), gen);
+		for (size_t i = 0; i < rows.size() / 5; i++)
 		{
-			int randomIndex = std::uniform_int_distribution<int>(numTargets * (c - 1), numTargets * c - 1)(gen);
-			selectedIndices.insert(randomIndex);
+			selected[rows[i]] = true;
 		}
 	}
-	std::vector<decltype(trainInputs)::value_type> newTrainInputs, newTrainTargetsOneHot;
-	for (size_t i = 0; i < trainInputs.size(); ++i)
+	// The split is kept as row indices, rows stay in place
+	std::vector<size_t> trainRows, validRows;
+	for (size_t i = 0; i < database.Rows(); ++i)
 	{
-		if (selectedIndices.find(i) == selectedIndices.end())
+		if (selected[i])
 		{
-			newTrainInputs.push_back(trainInputs[i]);
-			newTrainTargetsOneHot.push_back(trainTargetsOneHot[i]);
+			validRows.push_back(i);
 		}
 		else
 		{
-			validInputs.push_back(trainInputs[i]);
-			validTargetsOneHot.push_back(trainTargetsOneHot[i]);
+			trainRows.push_back(i);
 		}
 	}
-	trainInputs = newTrainInputs;
-	trainTargetsOneHot = newTrainTargetsOneHot;
-	std::cout << "For train : " << trainInputs.size() << std::endl;
-	std::cout << "For valid : " << validInputs.size() << std::endl;
+	std::cout << "For train : " << trainRows.size() << std::endl;
+	std::cout << "For valid : " << validRows.size() << std::endl;
 
-	ModelCalculate::LogisticRegressionTargetsOneHotTraining(weights, trainInputs, validInputs, trainTargetsOneHot, validTargetsOneHot, 200);
+	ModelCalculate::LogisticRegressionTargetsOneHotTraining(weights, database, trainRows, validRows, ModelCalculate::epochs);
 
 	weightsAfterTraining = weights;
 }
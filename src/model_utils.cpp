@@ -2,6 +2,16 @@
 
 #include <iostream>
 #include <random>
+#include <algorithm>
+#include <charconv>
+#include <opencv2/opencv.hpp>
+#include <cstring>
+#include <cerrno>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 const std::vector<std::string> ModelUtils::targets =
 {
@@ -15,148 +25,471 @@ const std::vector<std::string> ModelUtils::targets =
 	"Grape_spot"
 };
 
+const std::string ModelUtils::DatasetExtension = ".LFB";
+
+const char* ModelUtils::MapFile(const std::string& filename, size_t& size)
+{
+	// Private read-only mapping, an empty file maps to an empty range
+	const int fd = ::open(filename.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || ::fstat(fd, &st) != 0) {
+		if (fd >= 0) {
+			::close(fd);
+		}
+		throw std::runtime_error("Unable to open " + filename);
+	}
+	size = st.st_size;
+	void* address = size > 0 ? ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+	::close(fd);
+	if (address == MAP_FAILED) {
+		throw std::runtime_error("Unable to map " + filename);
+	}
+	if (address != nullptr) {
+		::madvise(address, size, MADV_SEQUENTIAL);
+	}
+	return static_cast<const char*>(address);
+}
+
+uint8_t ModelUtils::ClassId(const std::string& target)
+{
+	const auto found = std::find(ModelUtils::targets.begin(), ModelUtils::targets.end(), target);
+	if (found == ModelUtils::targets.end()) {
+		throw std::runtime_error("Unknown target " + target);
+	}
+	return found - ModelUtils::targets.begin();
+}
+
+namespace {
+	bool WriteAll(int fd, const void* data, size_t size, off_t offset)
+	{
+		const char* bytes = static_cast<const char*>(data);
+		while (size > 0) {
+			const ssize_t written = ::pwrite(fd, bytes, size, offset);
+			if (written < 0 && errno == EINTR) {
+				continue;
+			}
+			if (written <= 0) {
+				return false;
+			}
+			bytes += written;
+			size -= written;
+			offset += written;
+		}
+		return true;
+	}
+}
+
+DatasetWriter::DatasetWriter(const std::string& filename, bool singlePrecision, const std::string& featureSettings)
+	: filename(filename)
+{
+	this->header = {{'L', 'F', 'D', 'S'}, 3, 0, 0, singlePrecision ? 4u : 8u, static_cast<uint32_t>(ModelUtils::targets.size()), DatasetWriter::BlockRows, 0, 0};
+
+	// Class names, then the feature settings, each prefixed by its length
+	std::string classTable;
+	for (const auto& target : ModelUtils::targets) {
+		const uint32_t length = target.size();
+		classTable.append(reinterpret_cast<const char*>(&length), sizeof(length));
+		classTable += target;
+	}
+	const uint32_t settingsLength = featureSettings.size();
+	classTable.append(reinterpret_cast<const char*>(&settingsLength), sizeof(settingsLength));
+	classTable += featureSettings;
+	// Blocks aligned for vector loads
+	this->header.featuresOffset = (sizeof(ModelUtils::DatasetHeader) + classTable.size() + 63) / 64 * 64;
+	classTable.resize(this->header.featuresOffset - sizeof(ModelUtils::DatasetHeader), '\0');
+
+	// Written aside, the previous dataset stays in place until Close()
+	const std::string temporaryPath = filename + ".tmp";
+	this->fd = ::open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (this->fd < 0 ||
+		!WriteAll(this->fd, &this->header, sizeof(ModelUtils::DatasetHeader), 0) ||
+		!WriteAll(this->fd, classTable.data(), classTable.size(), sizeof(ModelUtils::DatasetHeader))) {
+		if (this->fd >= 0) {
+			::close(this->fd);
+		}
+		throw std::runtime_error("Unable to write " + temporaryPath);
+	}
+}
+
+DatasetWriter::~DatasetWriter()
+{
+	// Rows of an unfinished run are kept in the temporary file, never under the final name
+	if (this->fd >= 0) {
+		try {
+			this->WriteBlock();
+		}
+		catch (...) {
+		}
+		::close(this->fd);
+	}
+}
+
+void DatasetWriter::Append(std::span<const double> features, uint8_t classId)
+{
+	if (this->Rows() == 0 && this->header.featureCount == 0) {
+		// The first row sets the block layout
+		this->header.featureCount = features.size();
+		this->header.blockSize = (DatasetWriter::BlockRows * (features.size() * this->header.valueSize + 1) + 63) / 64 * 64;
+		this->block.assign(this->header.blockSize, 0);
+	}
+	if (features.size() != this->header.featureCount) {
+		throw std::runtime_error("Row has " + std::to_string(features.size()) + " features, expected " + std::to_string(this->header.featureCount));
+	}
+	const size_t rowSize = this->header.featureCount * this->header.valueSize;
+	// Normalization statistics come with the rows, from the values as stored
+	if (this->header.valueSize == 4) {
+		float* row = reinterpret_cast<float*>(this->block.data() + this->pending * rowSize);
+		std::copy(features.begin(), features.end(), row);
+		this->stored.assign(row, row + features.size());
+		this->stats.Add(this->stored);
+	}
+	else {
+		std::memcpy(this->block.data() + this->pending * rowSize, features.data(), rowSize);
+		this->stats.Add(features);
+	}
+	this->block[DatasetWriter::BlockRows * rowSize + this->pending] = classId;
+	if (++this->pending == DatasetWriter::BlockRows) {
+		this->WriteBlock();
+	}
+}
+
+void DatasetWriter::Close()
+{
+	this->WriteBlock();
+	const int fd = this->fd;
+	this->fd = -1;
+	if (::fsync(fd) != 0 || ::close(fd) != 0) {
+		throw std::runtime_error("Unable to write " + this->filename + ".tmp");
+	}
+	// Complete, replaces the previous dataset in a single step
+	std::filesystem::rename(this->filename + ".tmp", this->filename);
+}
+
+void DatasetWriter::WriteBlock()
+{
+	if (this->pending == 0) {
+		return;
+	}
+	// Rows first, then the header that counts them
+	const off_t offset = this->header.featuresOffset + this->rows / DatasetWriter::BlockRows * this->header.blockSize;
+	if (!WriteAll(this->fd, this->block.data(), this->block.size(), offset)) {
+		throw std::runtime_error("Unable to write " + this->filename + ".tmp");
+	}
+	this->rows += this->pending;
+	this->pending = 0;
+	this->header.rowCount = this->rows;
+	if (!WriteAll(this->fd, &this->header, sizeof(ModelUtils::DatasetHeader), 0)) {
+		throw std::runtime_error("Unable to write " + this->filename + ".tmp");
+	}
+	std::fill(this->block.begin(), this->block.end(), 0);
+}
+
+void ModelUtils::SaveDataset(
+	const std::string& filename,
+	const FeatureMatrix& database,
+	bool singlePrecision,
+	const std::string& featureSettings)
+{
+	// The writer replaces the file only once every row is written
+	DatasetWriter writer(filename, singlePrecision, featureSettings);
+	for (size_t row = 0; row < database.Rows(); row++) {
+		writer.Append(database.Row(row), database.ClassId(row));
+	}
+	writer.Close();
+}
+
+bool ModelUtils::IsDataset(const std::string& filename)
+{
+	// Recognized by its magic, whatever the name: the temporary file of an interrupted run is one too
+	std::ifstream file(filename, std::ios::binary);
+	char magic[4] = {};
+	return file.read(magic, sizeof(magic)) && std::memcmp(magic, "LFDS", 4) == 0;
+}
+
+void ModelUtils::LoadDataset(
+	FeatureMatrix& database,
+	const std::string& filename,
+	std::string& featureSettings)
+{
+	std::cout << "\r\033[K" << "Loading " << filename << "..." << std::endl;
+	size_t size = 0;
+	const char* data = ModelUtils::MapFile(filename, size);
+	void* address = const_cast<char*>(data);
+	if (size < sizeof(DatasetHeader)) {
+		::munmap(address, size);
+		throw std::runtime_error("Invalid dataset " + filename);
+	}
+	DatasetHeader header;
+	std::memcpy(&header, data, sizeof(DatasetHeader));
+	const size_t rowSize = static_cast<size_t>(header.featureCount) * header.valueSize;
+	const size_t numBlocks = header.blockRows > 0 ? (header.rowCount + header.blockRows - 1) / header.blockRows : 0;
+	if (std::memcmp(header.magic, "LFDS", 4) != 0 || (header.version != 2 && header.version != 3) || (header.valueSize != 4 && header.valueSize != 8) ||
+		header.blockRows == 0 || (header.rowCount > 0 && header.blockSize < header.blockRows * (rowSize + 1)) ||
+		header.featuresOffset < sizeof(DatasetHeader) || header.featuresOffset > size ||
+		numBlocks > (size - header.featuresOffset) / std::max<uint64_t>(header.blockSize, 1)) {
+		::munmap(address, size);
+		throw std::runtime_error("Invalid dataset " + filename);
+	}
+
+	// Class table, mapped to the ids of this build, then the feature settings. Version 2 files have none
+	std::vector<uint8_t> classes;
+	size_t offset = sizeof(DatasetHeader);
+	try {
+		auto readString = [&]() {
+			uint32_t length = 0;
+			if (offset + sizeof(length) <= header.featuresOffset) {
+				std::memcpy(&length, data + offset, sizeof(length));
+			}
+			if (offset + sizeof(length) + length > header.featuresOffset) {
+				throw std::runtime_error("Invalid dataset " + filename);
+			}
+			const std::string text(data + offset + sizeof(length), length);
+			offset += sizeof(length) + length;
+			return text;
+		};
+		for (uint32_t i = 0; i < header.classCount; i++) {
+			classes.push_back(ModelUtils::ClassId(readString()));
+		}
+		featureSettings = header.version >= 3 ? readString() : "";
+		if (!database.Empty() && database.Cols() != header.featureCount) {
+			throw std::runtime_error("Feature count of " + filename + " does not match");
+		}
+	}
+	catch (...) {
+		::munmap(address, size);
+		throw;
+	}
+
+	// Rows are copied straight out of the mapping into the padded matrix
+	const size_t first = database.Rows();
+	database.Resize(first + header.rowCount, header.featureCount);
+	for (size_t row = 0; row < header.rowCount; row++) {
+		const char* block = data + header.featuresOffset + row / header.blockRows * header.blockSize;
+		const size_t index = row % header.blockRows;
+		const uint8_t classId = static_cast<uint8_t>(block[header.blockRows * rowSize + index]);
+		if (classId >= classes.size()) {
+			database.Resize(first, header.featureCount);
+			::munmap(address, size);
+			throw std::runtime_error("Invalid dataset " + filename);
+		}
+		database.ClassId(first + row) = classes[classId];
+		double* values = database.Row(first + row).data();
+		if (header.valueSize == 4) {
+			const float* source = reinterpret_cast<const float*>(block + index * rowSize);
+			std::copy(source, source + header.featureCount, values);
+		}
+		else {
+			std::memcpy(values, block + index * rowSize, rowSize);
+		}
+	}
+	::munmap(address, size);
+	std::cout << "Data loaded from " << filename << std::endl;
+}
+
 void ModelUtils::SaveDataFile(
 	const std::string& filename,
-	const std::vector<DataEntry>& database)
-{
-	std::ofstream outputfile(filename);
-	if (outputfile.is_open()) {
-		for (size_t i = 0; i < database.size(); i++) {
-			outputfile << database[i].index << ",";
-			outputfile << database[i].target << ",";
-			for (size_t j = 0; j < database[i].features.size(); j++) {
-				outputfile << std::fixed << database[i].features[j];
-				if (j < database[i].features.size() - 1) {
-					outputfile << ",";
-				}
-				else {
-					outputfile << std::endl;
+	const FeatureMatrix& database)
+{
+	std::ofstream outputfile(filename, std::ios::binary | std::ios::trunc);
+	if (!outputfile.is_open()) {
+		throw std::runtime_error("Unable to open " + filename);
+	}
+	// Blocks of rows are formatted in parallel, then written in order, a round of blocks at a time
+	const size_t rowsPerBlock = 1024;
+	const size_t numBlocks = (database.Rows() + rowsPerBlock - 1) / rowsPerBlock;
+	const size_t blocksPerRound = std::max(1, cv::getNumThreads()) * 4;
+	std::vector<std::string> buffers(blocksPerRound);
+	for (size_t round = 0; round < numBlocks; round += blocksPerRound) {
+		const size_t blocks = std::min(blocksPerRound, numBlocks - round);
+		cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range& range) {
+			char number[512]; // Widest fixed double
+			for (int block = range.start; block < range.end; block++) {
+				std::string& buffer = buffers[block];
+				buffer.clear();
+				const size_t first = (round + block) * rowsPerBlock;
+				for (size_t i = first; i < std::min(first + rowsPerBlock, database.Rows()); i++) {
+					buffer.append(number, std::to_chars(number, number + sizeof(number), i).ptr);
+					buffer += ',';
+					buffer += ModelUtils::targets[database.ClassId(i)];
+					for (const double value : database.Row(i)) {
+						// Same six decimals as std::fixed
+						buffer += ',';
+						buffer.append(number, std::to_chars(number, number + sizeof(number), value, std::chars_format::fixed, 6).ptr);
+					}
+					buffer += '\n';
 				}
 			}
+			});
+		for (size_t block = 0; block < blocks; block++) {
+			outputfile.write(buffers[block].data(), buffers[block].size());
 		}
-		outputfile.close();
 	}
-	else {
-		throw std::runtime_error("Unable to open " + filename);
+	if (!outputfile.flush()) {
+		throw std::runtime_error("Unable to write " + filename);
 	}
 }
 
 void ModelUtils::LoadDataFile(
-	std::vector<DataEntry>& database,
+	FeatureMatrix& database,
 	const std::string& filename)
 {
-	std::cout << "\r\033[K" << "Loading data.csv..." << std::endl;
-	std::ifstream inputfile(filename);
+	std::cout << "\r\033[K" << "Loading " << filename << "..." << std::endl;
+	size_t size = 0;
+	const char* data = ModelUtils::MapFile(filename, size);
 
-	if (!inputfile.is_open()) {
-		throw std::runtime_error("Unable to open " + filename);
+	// Newline-aligned chunks, parsed in parallel
+	const size_t numChunks = std::max<size_t>(1, std::min<size_t>(cv::getNumThreads() * 4, size / (1 << 16)));
+	std::vector<size_t> starts(numChunks + 1, size);
+	starts[0] = 0;
+	for (size_t chunk = 1; chunk < numChunks; chunk++) {
+		const size_t position = std::max(starts[chunk - 1], size * chunk / numChunks);
+		const char* newline = static_cast<const char*>(std::memchr(data + position, '\n', size - position));
+		starts[chunk] = newline != nullptr ? newline - data + 1 : size;
 	}
-
-	std::string entry;
-	while (std::getline(inputfile, entry)) {
-		std::istringstream linestream(entry);
-		std::string element;
-		std::vector<std::string> row;
-		while (std::getline(linestream, element, ',')) {
-			row.push_back(element);
+	auto forEachLine = [&](size_t chunk, const std::function<void(const char*, const char*)>& process) {
+		for (const char* line = data + starts[chunk]; line < data + starts[chunk + 1];) {
+			const char* newline = static_cast<const char*>(std::memchr(line, '\n', data + starts[chunk + 1] - line));
+			const char* end = newline != nullptr ? newline : data + starts[chunk + 1];
+			const char* next = newline != nullptr ? newline + 1 : end;
+			if (end > line && end[-1] == '\r') {
+				end--;
+			}
+			if (end > line) {
+				process(line, end);
+			}
+			line = next;
 		}
-		DataEntry entry;
-		entry.index = std::stoi(row[0]);
-		entry.target = row[1];
-		for (size_t i = 2; i < row.size(); i++) {
-			entry.features.push_back(std::stod(row[i]));
+	};
+
+	// Rows of each chunk, then their place in the preallocated matrix
+	std::vector<size_t> firstRows(numChunks + 1, 0);
+	cv::parallel_for_(cv::Range(0, numChunks), [&](const cv::Range& range) {
+		for (int chunk = range.start; chunk < range.end; chunk++) {
+			forEachLine(chunk, [&](const char*, const char*) { firstRows[chunk + 1]++; });
 		}
-		database.push_back(entry);
+		});
+	for (size_t chunk = 0; chunk < numChunks; chunk++) {
+		firstRows[chunk + 1] += firstRows[chunk];
 	}
+	// Feature count of the first row sizes every row
+	const char* firstEnd = size > 0 ? static_cast<const char*>(std::memchr(data, '\n', size)) : nullptr;
+	const size_t numFeatures = std::max<ptrdiff_t>(0, std::count(data, firstEnd != nullptr ? firstEnd : data + size, ',') - 1);
+	if (!database.Empty() && database.Cols() != numFeatures) {
+		::munmap(const_cast<char*>(data), size);
+		throw std::runtime_error("Feature count of " + filename + " does not match");
+	}
+	const size_t first = database.Rows();
+	database.Resize(first + firstRows[numChunks], numFeatures);
 
-	inputfile.close();
+	// Fields are parsed in place, errors are reported once every chunk is done
+	std::vector<size_t> invalidRows(numChunks, 0);
+	cv::parallel_for_(cv::Range(0, numChunks), [&](const cv::Range& range) {
+		for (int chunk = range.start; chunk < range.end; chunk++) {
+			size_t row = first + firstRows[chunk];
+			forEachLine(chunk, [&](const char* line, const char* end) {
+				const size_t current = row++;
+				auto invalid = [&]() { invalidRows[chunk] = invalidRows[chunk] ? invalidRows[chunk] : current - first + 1; };
+				const char* comma = std::find(line, end, ',');
+				const char* targetEnd = std::find(comma + (comma < end), end, ',');
+				size_t index;
+				if (std::from_chars(line, comma, index).ec != std::errc() || comma == end) {
+					return invalid();
+				}
+				const auto target = std::find(ModelUtils::targets.begin(), ModelUtils::targets.end(), std::string_view(comma + 1, targetEnd - comma - 1));
+				if (target == ModelUtils::targets.end()) {
+					return invalid();
+				}
+				database.ClassId(current) = target - ModelUtils::targets.begin();
+				double* values = database.Row(current).data();
+				size_t count = 0;
+				for (const char* field = targetEnd; field < end; count++) {
+					const auto result = count < numFeatures ? std::from_chars(field + 1, end, values[count]) : std::from_chars_result{field, std::errc::invalid_argument};
+					if (result.ec != std::errc() || (result.ptr != end && *result.ptr != ',')) {
+						return invalid();
+					}
+					field = result.ptr;
+				}
+				if (count != numFeatures) {
+					invalid();
+				}
+				});
+		}
+		});
+	::munmap(const_cast<char*>(data), size);
+	for (const size_t invalidRow : invalidRows) {
+		if (invalidRow != 0) {
+			database.Resize(first, numFeatures);
+			throw std::runtime_error("Invalid row " + std::to_string(invalidRow) + " in " + filename);
+		}
+	}
 	std::cout << "Data loaded from " << filename << std::endl;
 }
 
 void ModelUtils::NormalizationZScore(
-	std::vector<DataEntry>& database,
+	FeatureMatrix& database,
+	const FeatureStats& stats,
 	std::vector<double>& featureMeans,
 	std::vector<double>& featureStdDevs)
 {
-	const size_t numFeatures = database[0].features.size();
-
+	const size_t numFeatures = database.Cols();
+	if (stats.Cols() != numFeatures) {
+		throw std::runtime_error("Feature statistics do not match the dataset");
+	}
+	// Features with a standard deviation of zero are filtered out
+	std::vector<size_t> columns;
 	for (size_t i = 0; i < numFeatures; ++i) {
-		std::vector<double> featureValues;
-		for (const DataEntry& entry : database) {
-			featureValues.push_back(entry.features[i]);
-		}
-		// Calculate mean
-		double sum = 0.0;
-		for (const double& value : featureValues) {
-			sum += value;
+		featureMeans.push_back(stats.Mean(i));
+		featureStdDevs.push_back(stats.StdDev(i));
+		if (featureStdDevs[i] != 0.0) {
+			columns.push_back(i);
 		}
-		double mean = sum / database.size();
-
-		// Calculate standard deviation
-		double sumSquaredDiff = 0.0;
-		for (const double& value : featureValues) {
-			double diff = value - mean;
-			sumSquaredDiff += diff * diff;
-		}
-		double standardDeviation = std::sqrt(sumSquaredDiff / database.size());
-
-		featureMeans.push_back(mean);
-		featureStdDevs.push_back(standardDeviation);
 	}
 
-	//Filter
-	for (DataEntry& entry : database) {
-		std::vector<double> newFeatures;
-		for (size_t i = 0; i < numFeatures; ++i) {
-			// Filter out standard deviation zero
-			if (featureStdDevs[i] != 0.0) {
-				newFeatures.push_back((entry.features[i] - featureMeans[i]) / featureStdDevs[i]);
+	// Rows are normalized and compacted in place, each within its own span
+	cv::parallel_for_(cv::Range(0, database.Rows()), [&](const cv::Range& range) {
+		for (int row = range.start; row < range.end; row++) {
+			double* values = database.Row(row).data();
+			for (size_t j = 0; j < columns.size(); ++j) {
+				values[j] = (values[columns[j]] - featureMeans[columns[j]]) / featureStdDevs[columns[j]];
 			}
 		}
-		entry.features = newFeatures;
-	}
+		});
+	database.Truncate(columns.size());
 }
 
 void ModelUtils::SetupTrainingData(
-	const std::vector<DataEntry>& database,
-	std::vector<std::vector<double>>& weights,
-	std::vector<std::vector<double>>& trainInputs,
-	std::vector<std::vector<double>>& trainTargetsTargetsOneHot)
+	const FeatureMatrix& database,
+	std::vector<std::vector<double>>& weights)
 {
-	const size_t numEntries = database.size();
 	const size_t numTargets = ModelUtils::targets.size();
-	const size_t numFeatures = database[0].features.size();
+	const size_t numFeatures = database.Cols();
 	// Init weights
 	std::random_device rd;
 	std::mt19937 gen(rd());
 	std::uniform_real_distribution<double> distribution(-0.1, 0.1);
 	for (size_t target = 0; target < numTargets; ++target) {
+		weights[target].resize(numFeatures);
 		for (size_t feature = 0; feature < numFeatures; ++feature) {
 			weights[target][feature] = distribution(gen);
 		}
 	}
-	for (size_t entry = 0; entry < numEntries; entry++) {
-		// Add train input
-		trainInputs.push_back(database[entry].features);
-		// Add train one-hot
-		std::vector<double> result(numTargets, 0.0);
-		for (size_t target = 0; target < numTargets; ++target) {
-			if (ModelUtils::targets[target] == database[entry].target) {
-				result[target] = 1.0;
-				break;
-			}
-		}
-		trainTargetsTargetsOneHot.push_back(result);
-	}
 }
 
 std::string ModelUtils::SaveModels(
 	const std::vector<std::vector<double>>& weights,
 	const std::vector<double>& featureMeans,
-	const std::vector<double>& featureStdDevs)
+	const std::vector<double>& featureStdDevs,
+	ModelType modelType,
+	const std::string& featureSettings)
 {
 	std::ostringstream oss;
 
+	// Model type
+	oss << (modelType == ModelType::Softmax ? "softmax" : "sigmoid") << "\n";
+	// Settings the features were extracted with
+	if (!featureSettings.empty()) {
+		oss << "features " << featureSettings << "\n";
+	}
 	// Mean
 	for (double mean : featureMeans) {
 		oss << mean << " ";
@@ -183,6 +516,8 @@ void ModelUtils::LoadModels(
 	std::vector<std::vector<double>>& weights,
 	std::vector<double>& featureMeans,
 	std::vector<double>& featureStdDevs,
+	ModelType& modelType,
+	std::string& featureSettings,
 	const std::string& filename)
 {
 	std::ifstream file(filename);
@@ -197,8 +532,22 @@ void ModelUtils::LoadModels(
 
 	std::string line;
 
+	// Model type, files without it hold sigmoid models
+	modelType = ModelType::Sigmoid;
+	if (std::getline(file, line) && (line == "sigmoid" || line == "softmax")) {
+		modelType = line == "softmax" ? ModelType::Softmax : ModelType::Sigmoid;
+		std::getline(file, line);
+	}
+
+	// Feature settings, unknown for files without them
+	featureSettings.clear();
+	if (line.starts_with("features ")) {
+		featureSettings = line.substr(9);
+		std::getline(file, line);
+	}
+
 	// Load feature means
-	if (std::getline(file, line)) {
+	if (!line.empty()) {
 		std::istringstream meanStream(line);
 		double mean;
 		while (meanStream >> mean) {
@@ -2,10 +2,107 @@
 #include "image_processing.h"
 #include "model_utils.h"
 #include "model_calculate.h"
+#include "image_pack.h"
+#include "dataset_manifest.h"
+#include "image_dependencies.h"
+#include "feature_cache.h"
+#include "generation_tree.h"
+#include "image_reader.h"
+#include "vector_kernels.h"
 
 #include <iostream>
+#include <filesystem>
 
-void processImagesInDirectory(const std::string& source, const std::vector<double>& featureMeans, const std::vector<double>& featureStdDevs, const std::vector<std::vector<double>>& weights)
+std::string generatedDirectory(const std::string& root, const std::string& target)
+{
+	// Transformations are read from the published generation tree
+	const std::string generated = GenerationTree::Current(root);
+	if (generated.empty()) {
+		throw std::runtime_error("No generated images under " + root);
+	}
+	return generated + target + "/";
+}
+
+std::vector<std::string> samplePaths(const std::string& imagePath, const std::string& generatedPath)
+{
+	// The pack of the sample, or the original and the file of each transformed view
+	const std::string name = generatedPath + std::filesystem::path(imagePath).stem().string();
+	if (ImageUtils::packed) {
+		return {name + "_T" + ImagePack::Extension};
+	}
+	std::vector<std::string> paths = {imagePath};
+	for (int i = 1; i < 7; i++) {
+		// The ORB view is described from T1 keypoints
+		const int transformation = ImageProcessing::keyPointFeatures && i == ImageProcessing::ORBView ? 1 : i;
+		paths.push_back(name + "_T" + std::to_string(transformation) + ImageCodec::Extension(ImageUtils::format));
+	}
+	return paths;
+}
+
+std::vector<double> extractSampleFeatures(const std::vector<std::string>& paths, const std::vector<uchar>* buffers)
+{
+	// Features of the seven views, read from the feature cache when the view did not change
+	std::vector<double> sampleFeatures;
+	std::vector<std::vector<double>> featureGroups(7);
+	if (ImageUtils::packed) {
+		// Planes are only decoded when a view misses the cache
+		const uint64_t packHash = ImageDependencies::Hash(buffers[0].data(), buffers[0].size());
+		std::vector<cv::Mat> planes;
+		for (int i = 0; i < 7; i++) {
+			featureGroups[i] = FeatureCache::Extract(ImageDependencies::Hash(&i, sizeof(i), packHash), i, [&]() {
+				if (planes.empty()) {
+					std::vector<std::string> planeNames;
+					planes = ImagePack::Decode(buffers[0].data(), buffers[0].size(), planeNames, paths[0]);
+					if (ImageProcessing::keyPointFeatures) {
+						planes.insert(planes.begin() + ImageProcessing::ORBView, planes[1]);
+					}
+				}
+				return planes[i];
+				});
+		}
+	}
+	else {
+		for (int i = 0; i < 7; i++) {
+			featureGroups[i] = FeatureCache::Extract(paths[i], buffers[i], i);
+		}
+	}
+	for (const auto& featureGroup : featureGroups) {
+		sampleFeatures.insert(sampleFeatures.end(), featureGroup.begin(), featureGroup.end());
+	}
+	return sampleFeatures;
+}
+
+void normalizeFeatures(const std::vector<double>& features, const std::vector<double>& featureMeans, const std::vector<double>& featureStdDevs, std::span<double> row)
+{
+	// A sample described with other feature settings than the model's can not be normalized
+	if (features.size() != featureMeans.size() || features.size() != featureStdDevs.size()) {
+		throw std::runtime_error("Sample has " + std::to_string(features.size()) + " features, the model expects " + std::to_string(featureStdDevs.size()));
+	}
+	// Normalization z-score / Filter out standard deviation zero
+	size_t column = 0;
+	for (size_t i = 0; i < features.size(); ++i) {
+		if (featureStdDevs[i] != 0.0) {
+			if (column == row.size()) {
+				throw std::runtime_error("Features do not match the model");
+			}
+			row[column++] = (features[i] - featureMeans[i]) / featureStdDevs[i];
+		}
+	}
+	if (column != row.size()) {
+		throw std::runtime_error("Features do not match the model");
+	}
+}
+
+size_t predictRow(std::span<const double> row, const FeatureMatrix& weights)
+{
+	// Scores of every target in one matrix-vector product over whole padded rows, the padding is zero on both sides.
+	// Sigmoid and softmax are both increasing, so the highest score is the prediction of either model type
+	std::vector<double> scores(weights.Rows());
+	VectorKernels::Gemv(weights.Row(0).data(), weights.Rows(), weights.Stride(), row.data(), scores.data());
+	return std::max_element(scores.begin(), scores.end()) - scores.begin();
+}
+
+void processImagesInDirectory(const std::string& source, const std::vector<double>& featureMeans, const std::vector<double>& featureStdDevs, const FeatureMatrix& weights)
 {
 	std::vector<cv::Mat> images;
 
@@ -14,166 +111,86 @@ void processImagesInDirectory(const std::string& source, const std::vector<doubl
 	cv::parallel_for_(cv::Range(0, ModelUtils::targets.size()), [&](const cv::Range& range) {
 		for (int directory = range.start; directory < range.end; directory++) {
 			std::string directoryPath = source + ModelUtils::targets[directory] + "/";
+			const std::string generatedPath = generatedDirectory(source, ModelUtils::targets[directory]);
 			// Get images list
-			std::vector<std::string> names = ImageUtils::GetImagesInDirectory(directoryPath, 1640 * 7);
-			// Check all images from list
-			for (auto i = 0; i < names.size(); i++) {
+			std::vector<DatasetManifest::Record> records = DatasetManifest::GetRecords(directoryPath);
+			std::vector<std::string> names;
+			for (const auto& record : records) {
 				// Next if transformed image
-				if (names[i].find("_T") != std::string::npos) {
-					continue;
-				}
-				// Get image
-				cv::Mat originalImage = cv::imread(directoryPath + names[i]);
-				if (originalImage.empty()) {
-					continue;
-				}
-				// Get tranformed images
-				std::vector<cv::Mat> images;
-				images.push_back(originalImage.clone());
-				std::string name = directoryPath + names[i].substr(0, names[i].length() - 4);
-				for (int i = 1; i <= 6; ++i) {
-					cv::Mat image = cv::imread(name + "_T" + std::to_string(i) + ".JPG");
-					if (!image.empty()) {
-						images.push_back(image);
-					}
-					else {
-						throw std::runtime_error("Unable to load transformed image.");
-					}
-				}
-				// Create entry
-				DataEntry dataEntry;
-				// Add one-hot
-				dataEntry.target = ModelUtils::targets[directory];
-				size_t numTargets = 8;
-				std::vector<double> targetOneHot(numTargets, 0);
-				for (size_t target = 0; target < numTargets; ++target) {
-					if (ModelUtils::targets[target] == dataEntry.target) {
-						targetOneHot[target] = 1;
-						break;
-					}
+				if (record.variantId == 0 && !record.name.ends_with(ImagePack::Extension)) {
+					names.push_back(record.name);
 				}
-				// Add features 
-				for (int i = 0; i < 7; i++) {
-					std::vector<double> features;
-					std::vector<double> color = ImageProcessing::ExtractColorCaracteristics(images[i]);
-					std::vector<double> texture = ImageProcessing::ExtractTextureCaracteristics(images[i]);
-					features.insert(features.end(), color.begin(), color.end());
-					features.insert(features.end(), texture.begin(), texture.end());
-
-					for (const auto feature : features) {
-						dataEntry.features.push_back(feature);
-					}
-				}
-				// Normalization z-score / Filter out standard deviation zero
-				size_t numFeatures = dataEntry.features.size();
-				std::vector<double> newFeatures;
-				for (size_t i = 0; i < numFeatures; ++i) {
-					if (featureStdDevs[i] != 0.0) {
-						newFeatures.push_back((dataEntry.features[i] - featureMeans[i]) / featureStdDevs[i]);
-					}
-				}
-				dataEntry.features = newFeatures;
-				// Check accuracy
-				double maxProbability = -1.0;
-				size_t predictedTarget = 0;
-				for (size_t j = 0; j < numTargets; ++j) {
-					double probability = ModelCalculate::LogisticRegressionHypothesis(weights[j], dataEntry.features);
-					if (probability > maxProbability) {
-						maxProbability = probability;
-						predictedTarget = j;
-					}
+			}
+			// Check all images from list, the files of the next samples are read while the current ones are checked
+			const size_t filesPerSample = ImageUtils::packed ? 1 : 7;
+			std::vector<std::string> paths;
+			for (const auto& name : names) {
+				const std::vector<std::string> sample = samplePaths(directoryPath + name, generatedPath);
+				paths.insert(paths.end(), sample.begin(), sample.end());
+			}
+			ImageReader::ForEachBatch(paths, 16 * filesPerSample, [&](size_t first, std::vector<std::vector<uchar>>& buffers) {
+				// Normalized rows of the batch, predicted in place
+				FeatureMatrix batch(buffers.size() / filesPerSample, weights.Cols());
+				for (size_t sample = 0; sample < batch.Rows(); sample++) {
+					batch.ClassId(sample) = directory;
+					normalizeFeatures(extractSampleFeatures(std::vector<std::string>(paths.begin() + first + sample * filesPerSample, paths.begin() + first + (sample + 1) * filesPerSample), buffers.data() + sample * filesPerSample), featureMeans, featureStdDevs, batch.Row(sample));
 				}
-				{
-					// Display result
-					std::lock_guard<std::mutex> lock(ImageUtils::mutex);
-					ImageUtils::numComplete++;
-					if (targetOneHot[predictedTarget] == 1) {
-						std::cout << "\033[" << 1 << ";0H";
-						std::cout << "\r\033[K" << "\033[32m" << " VALID : " << ImageUtils::progress << "\033[0m ";
-						std::cout << ((double)ImageUtils::progress / ImageUtils::numComplete) * 100.0 << std::flush;
-						ImageUtils::progress++;
-					}
-					else {
-						std::cout << "\033[" << 2 << ";0H";
-						std::cout << "\r\033[K" << "\033[31m" << " WRONG : " << ImageUtils::numComplete - ImageUtils::progress << "\033[0m ";
-						std::cout << (1.0 - ((double)ImageUtils::progress / ImageUtils::numComplete)) * 100.0 << std::flush;
+				for (size_t sample = 0; sample < batch.Rows(); sample++) {
+					// Check accuracy
+					const size_t predictedTarget = predictRow(batch.Row(sample), weights);
+					{
+						// Display result
+						std::lock_guard<std::mutex> lock(ImageUtils::mutex);
+						ImageUtils::numComplete++;
+						if (predictedTarget == batch.ClassId(sample)) {
+							std::cout << "\033[" << 1 << ";0H";
+							std::cout << "\r\033[K" << "\033[32m" << " VALID : " << ImageUtils::progress << "\033[0m ";
+							std::cout << ((double)ImageUtils::progress / ImageUtils::numComplete) * 100.0 << std::flush;
+							ImageUtils::progress++;
+						}
+						else {
+							std::cout << "\033[" << 2 << ";0H";
+							std::cout << "\r\033[K" << "\033[31m" << " WRONG : " << ImageUtils::numComplete - ImageUtils::progress << "\033[0m ";
+							std::cout << (1.0 - ((double)ImageUtils::progress / ImageUtils::numComplete)) * 100.0 << std::flush;
+						}
+						std::cout << "\033[" << 3 << ";0H";
 					}
-					std::cout << "\033[" << 3 << ";0H";
 				}
-			}
+			});
 		}});
 	
 }
 
-void predictTarget(const std::string& source, const std::vector<double>& featureMeans, const std::vector<double>& featureStdDevs, const std::vector<std::vector<double>>& weights)
+void predictTarget(const std::string& source, const std::vector<double>& featureMeans, const std::vector<double>& featureStdDevs, const FeatureMatrix& weights)
 {
-	// Get image
-	cv::Mat originalImage = cv::imread(source);
-	if (originalImage.empty()) {
-		throw std::runtime_error("Unable to load image.");
-	}
+	// The image sits in its class directory, under the dataset root
+	const std::filesystem::path classPath = std::filesystem::path(source).parent_path();
+	const std::string generatedPath = generatedDirectory(classPath.parent_path().generic_string(), classPath.filename().string());
+	const std::vector<std::string> paths = samplePaths(source, generatedPath);
+	const std::vector<std::vector<uchar>> buffers = ImageReader::Read(paths);
 
-	// Get transformed images
+	// Original and T1 images to display, both at the size of the original: the original is decoded in full,
+	// the leaf region decode only serves the transformation stage
 	std::vector<cv::Mat> images;
-	images.push_back(originalImage.clone());
-	for (int i = 1; i <= 6; ++i) {
-		std::string path = source.substr(0, source.length() - 4) + "_T" + std::to_string(i) + ".JPG";
-		cv::Mat image = cv::imread(path);
-
-		if (!image.empty()) {
-			images.push_back(image);
-		}
-		else {
-			throw std::runtime_error("Unable to load transformed image.");
-		}
+	if (ImageUtils::packed) {
+		std::vector<std::string> planeNames;
+		images = ImagePack::Decode(buffers[0].data(), buffers[0].size(), planeNames, paths[0]);
 	}
-
-	// Create entry
-	DataEntry dataEntry;
-
-	// Add one-hot
-	size_t lastSlash = source.rfind('/');
-	size_t secondLastSlash = source.rfind('/', lastSlash - 1);
-	dataEntry.target = source.substr(secondLastSlash + 1, lastSlash - secondLastSlash - 1);
-	size_t numTargets = 8;
-	std::vector<double> targetOneHot(numTargets, 0);
-	for (size_t target = 0; target < numTargets; ++target) {
-		if (ModelUtils::targets[target] == dataEntry.target) {
-			targetOneHot[target] = 1;
-			break;
-		}
-	}
-	// Add features 
-	for (int i = 0; i < 7; i++) {
-		std::vector<double> features;
-		std::vector<double> color = ImageProcessing::ExtractColorCaracteristics(images[i]);
-		std::vector<double> texture = ImageProcessing::ExtractTextureCaracteristics(images[i]);
-		features.insert(features.end(), color.begin(), color.end());
-		features.insert(features.end(), texture.begin(), texture.end());
-		for (const auto feature : features) {
-			dataEntry.features.push_back(feature);
-		}
+	else {
+		images.push_back(ImageCodec::Decode(buffers[0].data(), buffers[0].size()));
+		images.push_back(ImageCodec::Decode(buffers[1].data(), buffers[1].size()));
 	}
-	// Normalization z-score / Filter out standard deviation zero
-	size_t numFeatures = dataEntry.features.size();
-	std::vector<double> newFeatures;
-	for (size_t i = 0; i < numFeatures; ++i) {
-		if (featureStdDevs[i] != 0.0) {
-			newFeatures.push_back((dataEntry.features[i] - featureMeans[i]) / featureStdDevs[i]);
-		}
+	if (images.size() < 2 || images[0].empty() || images[1].empty()) {
+		throw std::runtime_error("Unable to load image.");
 	}
-	dataEntry.features = std::move(newFeatures);
+	cv::Mat originalImage = images[0].clone();
+
+	// Normalized features of the sample
+	FeatureMatrix sample(1, weights.Cols());
+	normalizeFeatures(extractSampleFeatures(paths, buffers.data()), featureMeans, featureStdDevs, sample.Row(0));
 
 	// Check accuracy
-	double maxProbability = -1.0;
-	size_t predictedTarget = 0;
-	for (size_t j = 0; j < numTargets; ++j) {
-		double probability = ModelCalculate::LogisticRegressionHypothesis(weights[j], dataEntry.features);
-		if (probability > maxProbability) {
-			maxProbability = probability;
-			predictedTarget = j;
-		}
-	}
+	const size_t predictedTarget = predictRow(sample.Row(0), weights);
 	const std::string text = "Prediction: " + ModelUtils::targets[predictedTarget];
 
 	// Show
@@ -193,18 +210,68 @@ void predictTarget(const std::string& source, const std::vector<double>& feature
 int main(int argc, char* argv[])
 {
 	try {
-		if (argc != 2) {
-			throw std::runtime_error("Usage: " + (std::string)argv[0] + " <source_path>");
+		if (argc < 2) {
+			throw std::runtime_error("Usage: " + (std::string)argv[0] + " <source_path> -orb <nfeatures> -kp -seg <heuristic|exg|exgr> -segscale <1|2|4> -pack -fmt <jpg|png|raw|qoi> -cache <cache_path>");
 		}
 		std::string source = argv[1];
+		std::string cache = "features.LFC";
+		// Feature flags given on the command line, checked against the model settings
+		std::vector<std::string> requestedSettings;
+
+		// Parse command-line arguments
+		for (int i = 2; i < argc; ++i) {
+			const std::string setting = ImageProcessing::ParseFeatureArgument(argc, argv, i);
+			if (!setting.empty()) {
+				requestedSettings.push_back(setting);
+				continue;
+			}
+			std::string arg = argv[i];
+			if (arg == "-pack") {
+				ImageUtils::packed = true;
+			}
+			else if (arg == "-fmt" && i + 1 < argc) {
+				ImageUtils::format = ImageCodec::ParseFormat(argv[i + 1]);
+				++i;
+			}
+			else if (arg == "-cache" && i + 1 < argc) {
+				cache = argv[i + 1];
+				++i;
+			}
+		}
 
 		//source = "images/test/image (550).JPG";
 
-		std::vector<std::vector<double>> weights;
+		std::vector<std::vector<double>> targetWeights;
 		std::vector<double> featureMeans;
 		std::vector<double> featureStdDevs;
-		ModelUtils::LoadModels(weights, featureMeans, featureStdDevs, "models.txt");
+		ModelUtils::ModelType modelType;
+		std::string featureSettings;
+		ModelUtils::LoadModels(targetWeights, featureMeans, featureStdDevs, modelType, featureSettings, "models.txt");
+		// Features are extracted with the settings the model was trained with
+		if (!featureSettings.empty()) {
+			ImageProcessing::ApplyFeatureSettings(featureSettings);
+			const std::string applied = " " + ImageProcessing::FeatureSettings() + " ";
+			for (const std::string& setting : requestedSettings) {
+				if (applied.find(" " + setting + " ") == std::string::npos) {
+					throw std::runtime_error("Model was trained with features " + featureSettings);
+				}
+			}
+		}
+		// Weights of every target as the rows of one matrix, laid out like the feature rows
+		FeatureMatrix weights;
+		for (size_t target = 0; target < targetWeights.size(); target++) {
+			weights.Append(targetWeights[target], target);
+		}
+		if (weights.Empty()) {
+			throw std::runtime_error("No model in models.txt");
+		}
+		// Checked once before any feature is extracted
+		const size_t keptFeatures = std::count_if(featureStdDevs.begin(), featureStdDevs.end(), [](double stdDev) { return stdDev != 0.0; });
+		if (featureMeans.size() != featureStdDevs.size() || keptFeatures != weights.Cols()) {
+			throw std::runtime_error("Inconsistent models.txt: " + std::to_string(featureMeans.size()) + " means, " + std::to_string(featureStdDevs.size()) + " deviations, " + std::to_string(weights.Cols()) + " weights");
+		}
 
+		FeatureCache::Open(cache);
 		if (source.length() > 4 && source.substr(source.length() - 4) == ".JPG") {
 			predictTarget(source, featureMeans, featureStdDevs, weights);
 		}
@@ -213,8 +280,11 @@ int main(int argc, char* argv[])
 			if (source.back() != '/') {
 				source += "/";
 			}
+			DatasetManifest::Open(source);
 			processImagesInDirectory(source, featureMeans, featureStdDevs, weights);
+			DatasetManifest::Close();
 		}
+		FeatureCache::Close();
 	}
 	catch (const std::exception& e) {
 		std::cerr << e.what() << std::endl;
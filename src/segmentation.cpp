@@ -0,0 +1,118 @@
+#include "image_processing.h"
+#include "image_utils.h"
+
+#include <iostream>
+#include <chrono>
+
+double intersectionOverUnion(const cv::Mat &reference, const cv::Mat &candidate)
+{
+	const int intersection = cv::countNonZero(reference & candidate);
+	const int unionArea = cv::countNonZero(reference | candidate);
+	if (unionArea == 0)
+	{
+		return 1.0;
+	}
+	return static_cast<double>(intersection) / unionArea;
+}
+
+void compareMasks(const std::string &source, ImageProcessing::Segmentation mode, int scale, int generation)
+{
+	std::vector<std::string> imageNames = ImageUtils::GetImagesInDirectory(source, generation);
+	double referenceTime = 0.0, candidateTime = 0.0;
+	double sumIoU = 0.0, minIoU = 1.0;
+	std::string worstImage;
+	size_t count = 0;
+	for (size_t i = 0; i < imageNames.size(); i++)
+	{
+		// Only source images, not generated ones
+		if (imageNames[i].find('_') != std::string::npos)
+		{
+			continue;
+		}
+		cv::Mat image = cv::imread(source + imageNames[i]);
+		if (image.empty())
+		{
+			throw std::runtime_error("Unable to load the image. " + source + imageNames[i]);
+		}
+
+		// Existing mask
+		auto start_time = std::chrono::high_resolution_clock::now();
+		cv::Mat reference = ImageProcessing::ExtractLeafMask(image, ImageProcessing::Segmentation::Heuristic, 1);
+		auto end_time = std::chrono::high_resolution_clock::now();
+		referenceTime += std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+		// Candidate mask
+		start_time = std::chrono::high_resolution_clock::now();
+		cv::Mat candidate = ImageProcessing::ExtractLeafMask(image, mode, scale);
+		end_time = std::chrono::high_resolution_clock::now();
+		candidateTime += std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+
+		const double iou = intersectionOverUnion(reference, candidate);
+		sumIoU += iou;
+		if (iou < minIoU)
+		{
+			minIoU = iou;
+			worstImage = imageNames[i];
+		}
+		count++;
+		std::cout << "\r\033[K" << imageNames[i] << " IoU " << std::fixed << std::setprecision(3) << iou << std::flush;
+	}
+	if (count == 0)
+	{
+		throw std::runtime_error("No source image in " + source);
+	}
+
+	std::cout << "\r\033[K"
+			  << "Images            : " << count << std::endl
+			  << "Mean IoU          : " << std::setprecision(4) << sumIoU / count << std::endl
+			  << "Min IoU           : " << minIoU << " (" << worstImage << ")" << std::endl
+			  << "Heuristic (ms)    : " << std::setprecision(3) << referenceTime * 0.001 / count << std::endl
+			  << "Candidate (ms)    : " << candidateTime * 0.001 / count << std::endl
+			  << "Speedup           : " << std::setprecision(2) << referenceTime / candidateTime << "x" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		if (argc < 2)
+		{
+			throw std::runtime_error("Usage: " + (std::string)argv[0] + " <source_path> -seg <heuristic|exg|exgr> -segscale <1|2|4> -gen <num_images>");
+		}
+		std::string source = argv[1];
+		ImageProcessing::segmentation = ImageProcessing::Segmentation::ExcessGreen;
+		int generation = 1640;
+
+		// Parse command-line arguments
+		for (int i = 2; i < argc; ++i)
+		{
+			// -seg and -segscale select the candidate mask
+			if (!ImageProcessing::ParseFeatureArgument(argc, argv, i).empty())
+			{
+				continue;
+			}
+			std::string arg = argv[i];
+			if (arg == "-gen" && i + 1 < argc)
+			{
+				generation = std::atoi(argv[i + 1]);
+				++i;
+			}
+			else if (arg == "-h")
+			{
+				std::cout << "Usage: " << argv[0] << " <source_path> -seg <heuristic|exg|exgr> -segscale <1|2|4> -gen <num_images>" << std::endl;
+				return 0;
+			}
+		}
+		if (source.back() != '/')
+		{
+			source += "/";
+		}
+		compareMasks(source, ImageProcessing::segmentation, ImageProcessing::segmentationScale, generation);
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -2,281 +2,364 @@
 #include "image_processing.h"
 #include "model_utils.h"
 #include "model_calculate.h"
+#include "image_pack.h"
+#include "image_store.h"
+#include "dataset_manifest.h"
+#include "image_dependencies.h"
+#include "feature_cache.h"
+#include "generation_tree.h"
+#include "image_reader.h"
 
 #include <iostream>
 #include <filesystem>
 #include <chrono>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <zip_file.hpp>
 
-std::vector<double> getCaracteristics(cv::Mat &image)
+struct DatabaseSample
 {
-	std::vector<double> features;
+	uint8_t classId;
+	// The pack, or the image of each view
+	std::vector<std::string> paths;
+};
 
-	std::vector<double> color = ImageProcessing::ExtractColorCaracteristics(image);
-	std::vector<double> texture = ImageProcessing::ExtractTextureCaracteristics(image);
-	features.insert(features.end(), color.begin(), color.end());
-	features.insert(features.end(), texture.begin(), texture.end());
-
-	return features;
-}
-
-void GenerateDatabase(std::string source, std::vector<DataEntry> &database, int generation)
+std::vector<DatabaseSample> ListSamples(const std::string &source, const std::string &generated, int generation)
 {
-	std::cout << "\r\033[K"
-			  << "Database generation..." << std::endl;
-	for (const auto &entry : std::filesystem::directory_iterator(source))
+	std::vector<DatabaseSample> samples;
+	for (const auto &target : DatasetManifest::Directories())
 	{
-		// Get the target of the folder
-		const std::string target = entry.path().filename().generic_string();
 		// Next if not expected directory
 		if (std::find(ModelUtils::targets.begin(), ModelUtils::targets.end(), target) == ModelUtils::targets.end())
 		{
 			continue;
 		}
-		const std::string folderPath = entry.path().generic_string() + "/";
-		const std::vector<std::string> imagePaths = ImageUtils::GetImagesInDirectory(folderPath, generation);
+		const uint8_t classId = ModelUtils::ClassId(target);
+		const std::string folderPath = (std::filesystem::path(source) / target).generic_string() + "/";
+		const std::string generatedPath = generated + target + "/";
+		const std::vector<DatasetManifest::Record> records = DatasetManifest::GetRecords(generatedPath);
+		if (ImageUtils::packed)
+		{
+			// One pack per sample, holding the original and its transformations
+			int numPacks = 0;
+			for (const auto &record : records)
+			{
+				if (record.name.ends_with(ImagePack::Extension) && DatasetManifest::Variant(record.variantId) == "T" && numPacks < generation / 7)
+				{
+					samples.push_back({classId, {generatedPath + record.name}});
+					numPacks++;
+				}
+			}
+			continue;
+		}
 
-		std::vector<std::vector<std::string>> imageGroups;
+		// Group heads by stem, source images are JPEG and augmentations use the generated format
+		std::unordered_map<std::string, std::string> heads;
+		for (const auto &directoryPath : {folderPath, generatedPath})
+		{
+			for (const auto &record : DatasetManifest::GetRecords(directoryPath))
+			{
+				if (record.variantId == 0 && !record.name.ends_with(ImagePack::Extension))
+				{
+					heads.emplace(std::filesystem::path(record.name).stem().string(), directoryPath + record.name);
+				}
+			}
+		}
 
-		// Parallel processing to split
-		std::unordered_map<std::string, size_t> imageGroupIndices;
-		cv::parallel_for_(cv::Range(0, imagePaths.size()), [&](const cv::Range &range)
-						  {
-			for (int i = range.start; i < range.end; i++) {
-				const std::string& imagePath = imagePaths[i];
-				const size_t position = imagePath.find_last_of('_');
-				if (position == std::string::npos || imagePath[position + 1] != 'T') {
+		// Transformations come sorted from the manifest, T1 to T6
+		std::vector<std::vector<std::string>> imageGroups;
+		std::unordered_map<int32_t, size_t> imageGroupIndices;
+		for (const auto &record : records)
+		{
+			if (record.variantId == 0 || record.name.ends_with(ImagePack::Extension))
+			{
+				continue;
+			}
+			auto group = imageGroupIndices.find(record.groupId);
+			if (group == imageGroupIndices.end())
+			{
+				if (static_cast<int>(imageGroups.size()) == generation / 7)
+				{
 					continue;
 				}
-				const std::string imageName = imagePath.substr(0, position);
+				const auto head = heads.find(record.name.substr(0, record.name.rfind("_T")));
+				if (head == heads.end())
 				{
-					std::lock_guard<std::mutex> lock(ImageUtils::mutex);
-					if (imageGroupIndices.find(imageName) == imageGroupIndices.end()) {
-						imageGroupIndices[imageName] = imageGroups.size();
-						imageGroups.push_back({ imageName + ".JPG", imagePath });
-					}
-					else {
-						imageGroups[imageGroupIndices[imageName]].push_back(imagePath);
-					}
+					throw std::runtime_error("No source image for " + generatedPath + record.name);
 				}
-			} });
-		// Parallel processing to sort
-		cv::parallel_for_(cv::Range(0, imageGroups.size()), [&](const cv::Range &range)
-						  {
-			for (int i = range.start; i < range.end; i++) {
-				std::vector<std::string>& imageGroup = imageGroups[i];
-				std::sort(imageGroup.begin() + 1, imageGroup.end(), [](const std::string& a, const std::string& b) {
-					std::string numeroA = a.substr(a.length() - 5, 1);
-					std::string numeroB = b.substr(b.length() - 5, 1);
-					int intA = std::stoi(numeroA);
-					int intB = std::stoi(numeroB);
-					return intA < intB;
-					});
-			} });
-
-		// Generate database
+				group = imageGroupIndices.emplace(record.groupId, imageGroups.size()).first;
+				imageGroups.push_back({head->second});
+			}
+			imageGroups[group->second].push_back(generatedPath + record.name);
+		}
 		for (auto &imageGroup : imageGroups)
 		{
+			// The ORB view is described from T1 keypoints
+			if (ImageProcessing::keyPointFeatures)
+			{
+				imageGroup.insert(imageGroup.begin() + ImageProcessing::ORBView, imageGroup[1]);
+			}
 			if (imageGroup.size() != 7)
 			{
 				throw std::runtime_error("Strange error");
 			}
-			DataEntry dataEntry;
-			std::vector<std::vector<double>> featureGroups(imageGroup.size());
-			// Parallel processing of each imageGroup
-			cv::parallel_for_(cv::Range(0, imageGroup.size()), [&](const cv::Range &range)
+			samples.push_back({classId, std::move(imageGroup)});
+		}
+	}
+	return samples;
+}
+
+std::string ShardName(int index, int count)
+{
+	// Next to the dataset of a single run
+	return "data." + std::to_string(index) + "of" + std::to_string(count);
+}
+
+void GenerateDatabase(std::string source, std::string generated, DatasetWriter &writer, int generation, int shardIndex = 0, int shardCount = 1)
+{
+	std::cout << "\r\033[K"
+			  << "Database generation..." << std::endl;
+	// Samples of every class, in class order, a shard takes a contiguous part so shards in order give the same rows
+	std::vector<DatabaseSample> samples = ListSamples(source, generated, generation);
+	samples = std::vector<DatabaseSample>(samples.begin() + samples.size() * shardIndex / shardCount, samples.begin() + samples.size() * (shardIndex + 1) / shardCount);
+	const size_t filesPerSample = ImageUtils::packed ? 1 : 7;
+	std::vector<std::string> filePaths;
+	for (const auto &sample : samples)
+	{
+		filePaths.insert(filePaths.end(), sample.paths.begin(), sample.paths.end());
+	}
+
+	// The files of the next window are read while the current one is described, a window is the reorder buffer
+	const size_t windowSamples = 64;
+	ImageReader::ForEachBatch(filePaths, windowSamples * filesPerSample, [&](size_t first, std::vector<std::vector<uchar>> &buffers)
 							  {
-				for (int i = range.start; i < range.end; ++i) {
-					// Get image
-					std::string filePath = folderPath + imageGroup[i];
-					cv::Mat image = cv::imread(filePath, cv::IMREAD_UNCHANGED);
-					if (image.empty()) {
-						throw std::runtime_error("Unable to load the image: " + filePath);
+		const size_t firstSample = first / filesPerSample;
+		const size_t numSamples = buffers.size() / filesPerSample;
+		// Planes of a pack are decoded once, only when one of its views misses the feature cache
+		std::vector<uint64_t> packHashes(ImageUtils::packed ? numSamples : 0);
+		std::vector<std::vector<cv::Mat>> planes(packHashes.size());
+		std::unique_ptr<std::once_flag[]> decoded(new std::once_flag[packHashes.size()]);
+		cv::parallel_for_(cv::Range(0, packHashes.size()), [&](const cv::Range &range) {
+			for (int sample = range.start; sample < range.end; sample++) {
+				packHashes[sample] = ImageDependencies::Hash(buffers[sample].data(), buffers[sample].size());
+			} });
+
+		// Every (sample, view) pair is a task with its own slot, errors included, so no lock is taken
+		std::vector<std::vector<double>> views(numSamples * 7);
+		std::vector<std::string> errors(views.size());
+		cv::parallel_for_(cv::Range(0, views.size()), [&](const cv::Range &range) {
+			for (int task = range.start; task < range.end; task++) {
+				const size_t sample = task / 7;
+				const int view = task % 7;
+				const DatabaseSample &databaseSample = samples[firstSample + sample];
+				try {
+					if (ImageUtils::packed) {
+						views[task] = FeatureCache::Extract(ImageDependencies::Hash(&view, sizeof(view), packHashes[sample]), view, [&]() {
+							std::call_once(decoded[sample], [&]() {
+								std::vector<std::string> planeNames;
+								std::vector<cv::Mat> packPlanes = ImagePack::Decode(buffers[sample].data(), buffers[sample].size(), planeNames, databaseSample.paths[0]);
+								// The ORB view is described from T1 keypoints
+								if (ImageProcessing::keyPointFeatures) {
+									packPlanes.insert(packPlanes.begin() + ImageProcessing::ORBView, packPlanes[1]);
+								}
+								if (packPlanes.size() != 7) {
+									throw std::runtime_error("Incomplete image pack: " + databaseSample.paths[0]);
+								}
+								planes[sample] = std::move(packPlanes); });
+							return planes[sample][view]; });
 					}
-					// Add features 
-					const std::vector<double> features = getCaracteristics(image);
-					{
-						std::lock_guard<std::mutex> lock(ImageUtils::mutex);
-						for (const auto &feature : features) {
-							featureGroups[i].push_back(feature);
-						}
-						// Display name
-						std::cout << "\r\033[K" << filePath << std::flush;
+					else {
+						views[task] = FeatureCache::Extract(databaseSample.paths[view], buffers[sample * 7 + view], view);
 					}
-				} });
-			// Add dataEntry to the database
-			dataEntry.index = database.size();
-			dataEntry.target = target;
-			for (const auto &featureGroup : featureGroups)
-			{
-				for (const auto feature : featureGroup)
-				{
-					dataEntry.features.push_back(feature);
 				}
+				catch (const std::exception &e) {
+					errors[task] = e.what();
+				}
+			} });
+
+		// Rows go to the file in sample order, a bad sample is left out
+		for (size_t sample = 0; sample < numSamples; sample++)
+		{
+			const DatabaseSample &databaseSample = samples[firstSample + sample];
+			const auto error = std::find_if(errors.begin() + sample * 7, errors.begin() + (sample + 1) * 7, [](const std::string &error)
+											{ return !error.empty(); });
+			if (error != errors.begin() + (sample + 1) * 7)
+			{
+				std::cerr << "\r\033[K" << "Skipped " << databaseSample.paths[0] << ": " << *error << std::endl;
+				continue;
 			}
-			database.push_back(dataEntry);
-			// Update and display progression
-			int progress = (database.size() * 100) / ((generation / 7) * 8);
-			int numComplete = (progress * 50) / 100;
-			int numRemaining = 50 - numComplete;
-			std::cout << "\n"
-					  << "[" << std::string(numComplete, '=') << std::string(numRemaining, ' ') << "] " << std::setw(3) << progress << "%";
-			std::cout << "\033[A";
+			std::vector<double> features;
+			for (int view = 0; view < 7; view++)
+			{
+				features.insert(features.end(), views[sample * 7 + view].begin(), views[sample * 7 + view].end());
+			}
+			writer.Append(features, databaseSample.classId);
 		}
-	}
+
+		// Display name and progression
+		int progress = ((firstSample + numSamples) * 100) / std::max<size_t>(samples.size(), 1);
+		int numComplete = (progress * 50) / 100;
+		int numRemaining = 50 - numComplete;
+		std::cout << "\r\033[K" << samples[firstSample + numSamples - 1].paths[0] << "\n"
+				  << "[" << std::string(numComplete, '=') << std::string(numRemaining, ' ') << "] " << std::setw(3) << progress << "%";
+		std::cout << "\033[A" << std::flush; });
 	std::cout << "\r\033[K"
-			  << "DataEntry generated : " << database.size() << std::endl;
+			  << "DataEntry generated : " << writer.Rows() << std::endl;
 }
 
-void DeleteExistingImages(const std::vector<std::filesystem::directory_entry> &filesystemDirectories)
+void BuildImageStore(const std::vector<std::filesystem::directory_entry> &filesystemDirectories, const std::string &store)
 {
-	std::cout << "Reseting..." << std::endl;
-	ImageUtils::numComplete = 0;
-	// Count files
-	cv::parallel_for_(cv::Range(0, filesystemDirectories.size()), [&](const cv::Range &range)
-					  {
-		for (int directory = range.start; directory < range.end; directory++) {
-			const std::string directoryPath = filesystemDirectories[directory].path().generic_string() + "/";
-			for (const auto& entry : std::filesystem::directory_iterator(directoryPath)) {
-				const std::string imageName = entry.path().filename().string();
-				if (imageName.find('_') != std::string::npos && entry.is_regular_file() && entry.path().extension() == ".JPG") {
-					{
-						std::lock_guard<std::mutex> lock(ImageUtils::mutex);
-						ImageUtils::numComplete++;
-					}
-				}
+	std::cout << "\r\033[K"
+			  << "Image store generation..." << std::endl;
+	// Source images only, generated ones change on every run
+	std::vector<std::string> imagePaths;
+	for (const auto &directory : filesystemDirectories)
+	{
+		if (!directory.is_directory())
+		{
+			continue;
+		}
+		const std::string directoryPath = directory.path().generic_string() + "/";
+		for (const auto &name : ImageUtils::GetImagesInDirectory(directoryPath, -1, ".JPG"))
+		{
+			if (name.find('_') == std::string::npos)
+			{
+				imagePaths.push_back(directoryPath + name);
 			}
-		} });
-	ImageUtils::progress = 0;
-	// Delete files
-	cv::parallel_for_(cv::Range(0, filesystemDirectories.size()), [&](const cv::Range &range)
-					  {
-		for (int directory = range.start; directory < range.end; directory++) {
-			const std::string directoryPath = filesystemDirectories[directory].path().generic_string() + "/";
-			for (const auto& entry : std::filesystem::directory_iterator(directoryPath)) {
-				const std::string imageName = entry.path().filename().string();
-				if (imageName.find('_') != std::string::npos && entry.is_regular_file() && entry.path().extension() == ".JPG") {
-					std::filesystem::remove(entry.path());
-					{
-						// Progression
-						std::lock_guard<std::mutex> lock(ImageUtils::mutex);
-						std::cout << "\r\033[K" << "Delete file : " << entry.path().generic_string();
-						int progress = (++ImageUtils::progress) * 100 / ImageUtils::numComplete;
-						int numComplete = (progress * 50) / 100;
-						int numRemaining = 50 - numComplete;
-						std::cout << "\n" << "[" << std::string(numComplete, '=') << std::string(numRemaining, ' ') << "] " << std::setw(3) << progress << "%" << std::flush;
-						std::cout << "\033[A";
-					}
-				}
+		}
+	}
+	ImageStore::Build(store, imagePaths, cv::Size(256, 256));
+	std::cout << "\r\033[K"
+			  << "Images stored : " << imagePaths.size() << std::endl;
+}
+
+void RemoveStaleImages(const std::vector<std::filesystem::directory_entry> &filesystemDirectories, char stage)
+{
+	// Generated images no up to date sample claims, left by other settings or a larger generation
+	size_t removed = 0;
+	for (const auto &directory : filesystemDirectories)
+	{
+		const std::string directoryPath = directory.path().generic_string() + "/";
+		const std::unordered_set<std::string> outputs = ImageDependencies::Sweep(directoryPath, stage);
+		for (const auto &record : DatasetManifest::GetRecords(directoryPath))
+		{
+			if (ImageUtils::IsGeneratedImage(record.name) && !outputs.count(record.name))
+			{
+				std::filesystem::remove(directoryPath + record.name);
+				removed++;
 			}
-		} });
-	std::cout << std::endl
-			  << "\r\033[K"
-			  << "\033[A"
-			  << "\r\033[K"
-			  << "\033[A"
-			  << "\r\033[K"
-			  << "Images deleted : " << ImageUtils::progress << std::endl;
+		}
+		DatasetManifest::Invalidate(directoryPath);
+	}
+	if (removed > 0)
+	{
+		std::cout << "\r\033[K"
+				  << "Stale images removed : " << removed << std::endl;
+	}
 }
 
-void GenerateAugmentations(const std::vector<std::filesystem::directory_entry> &filesystemDirectories, int generation)
+void GenerateAugmentations(const std::vector<std::filesystem::directory_entry> &filesystemDirectories, const std::vector<std::filesystem::directory_entry> &generatedDirectories, int generation)
 {
 	std::cout << "\r\033[K"
 			  << "Augmentations..." << std::endl;
 	std::vector<double> augGenerations(ModelUtils::targets.size(), generation);
 	// Count files
-	cv::parallel_for_(cv::Range(0, filesystemDirectories.size()), [&](const cv::Range &range)
-					  {
-		for (int directory = range.start; directory < range.end; directory++) {
-			const std::string directoryPath = filesystemDirectories[directory].path().generic_string() + "/";
-			for (const auto& entry : std::filesystem::directory_iterator(directoryPath)) {
-				if (entry.is_regular_file() && entry.path().extension() == ".JPG") {
-					if (--augGenerations[directory] == 0) {
-						break;
-					}
-				}
+	for (size_t directory = 0; directory < filesystemDirectories.size(); directory++)
+	{
+		const std::string directoryPath = filesystemDirectories[directory].path().generic_string() + "/";
+		for (const auto &record : DatasetManifest::GetRecords(directoryPath))
+		{
+			if (record.name.ends_with(".JPG") && --augGenerations[directory] == 0)
+			{
+				break;
 			}
-		} });
+		}
+	}
 	ImageUtils::numComplete = 0;
 	for (auto &augGeneration : augGenerations)
 	{
 		ImageUtils::numComplete += augGeneration;
 	}
 	ImageUtils::progress = 0;
-	// Augmentation files
-	cv::parallel_for_(cv::Range(0, filesystemDirectories.size()), [&](const cv::Range &range)
-					  {
-		for (int directory = range.start; directory < range.end; directory++) {
-			const std::string directoryPath = filesystemDirectories[directory].path().generic_string() + "/";
-			if (augGenerations[directory] > 0) {
-				ImageUtils::SaveAFromToDirectory(directoryPath, directoryPath, augGenerations[directory]);
-			}
-		} });
+	// Augmentation files, each directory runs its own pipeline over all cores
+	for (size_t directory = 0; directory < filesystemDirectories.size(); directory++)
+	{
+		const std::string directoryPath = filesystemDirectories[directory].path().generic_string() + "/";
+		if (augGenerations[directory] > 0)
+		{
+			ImageUtils::SaveAFromToDirectory(directoryPath, generatedDirectories[directory].path().generic_string() + "/", augGenerations[directory]);
+		}
+	}
 	std::cout << "\r\033[K"
 			  << "\033[A"
 			  << "\r\033[K"
 			  << "Augmentations generated : " << ImageUtils::progress << std::endl;
 }
 
-void GenerateTransformations(const std::vector<std::filesystem::directory_entry> &filesystemDirectories, int generation)
+void GenerateTransformations(const std::vector<std::filesystem::directory_entry> &filesystemDirectories, const std::vector<std::filesystem::directory_entry> &generatedDirectories, int generation)
 {
 	std::cout << "\r\033[K"
 			  << "Transformation..." << std::endl;
 	ImageUtils::numComplete = generation * 8;
 	ImageUtils::progress = 0;
-	// Transformation files
-	cv::parallel_for_(cv::Range(0, filesystemDirectories.size()), [&](const cv::Range &range)
-					  {
-		for (int directory = range.start; directory < range.end; directory++) {
-			const std::string directoryPath = filesystemDirectories[directory].path().generic_string() + "/";
-			ImageUtils::SaveTFromToDirectory(directoryPath, directoryPath, generation);
-		} });
+	// Transformation files, each directory runs its own pipeline over all cores
+	for (size_t directory = 0; directory < filesystemDirectories.size(); directory++)
+	{
+		const std::string directoryPath = filesystemDirectories[directory].path().generic_string() + "/";
+		ImageUtils::SaveTFromToDirectory(directoryPath, generatedDirectories[directory].path().generic_string() + "/", generation);
+	}
 	std::cout << "\r\033[K"
 			  << "\033[A"
 			  << "\r\033[K"
-			  << "Transformations generated : " << ImageUtils::progress * 6 << std::endl;
+			  << "Transformations generated : " << ImageUtils::progress * (ImageProcessing::keyPointFeatures ? 5 : 6) << std::endl;
 }
 
-void GenerateZip(const std::vector<std::filesystem::directory_entry> &filesystemDirectories, const std::string &source, const std::string &models)
+void GenerateZip(const std::vector<std::filesystem::directory_entry> &filesystemDirectories, const std::string &generated, const std::string &models)
 {
 	try
 	{
 		ImageUtils::numComplete = 0;
-		cv::parallel_for_(cv::Range(0, filesystemDirectories.size()), [&](const cv::Range &range)
-						  {
-			for (int directory = range.start; directory < range.end; directory++) {
-				const std::string directoryPath = filesystemDirectories[directory].path().generic_string() + "/";
-				for (const auto& entry : std::filesystem::directory_iterator(directoryPath)) {
-					const std::string imageName = entry.path().filename().string();
-					if (imageName.find('_') != std::string::npos && entry.is_regular_file() && entry.path().extension() == ".JPG") {
-						{
-							std::lock_guard<std::mutex> lock(ImageUtils::mutex);
-							ImageUtils::numComplete++;
-						}
-					}
+		std::vector<std::vector<std::filesystem::path>> generatedPaths(filesystemDirectories.size());
+		for (size_t directory = 0; directory < filesystemDirectories.size(); directory++)
+		{
+			for (const auto &record : DatasetManifest::GetRecords(filesystemDirectories[directory].path().generic_string()))
+			{
+				if (ImageUtils::IsGeneratedImage(record.name))
+				{
+					generatedPaths[directory].push_back(filesystemDirectories[directory].path() / record.name);
 				}
-			} });
+			}
+			ImageUtils::numComplete += generatedPaths[directory].size();
+		}
 		ImageUtils::progress = 0;
 		cv::parallel_for_(cv::Range(0, filesystemDirectories.size()), [&](const cv::Range &range)
 						  {
 			for (int directory = range.start; directory < range.end; directory++) {
 				miniz_cpp::zip_file zip;
-				for (const auto& entry : std::filesystem::directory_iterator(filesystemDirectories[directory])) {
-					const std::string imageName = entry.path().filename().string();
-					if (imageName.find('_') != std::string::npos && entry.is_regular_file() && entry.path().extension() == ".JPG") {
-						// calculate the relative path with respect to the base directory
-						std::string relativePath = std::filesystem::relative(entry.path(), source).generic_string();
-						zip.write(entry.path().string(), relativePath);
-						{
-							std::lock_guard<std::mutex> lock(ImageUtils::mutex);
-							int progress = (++ImageUtils::progress) * 100 / ImageUtils::numComplete;
-							int numComplete = (progress * 50) / 100;
-							int numRemaining = 50 - numComplete;
-							std::cout << "\r\033[K" << "Compressed : " << relativePath << std::flush;
-							std::cout << "\n" << "[" << std::string(numComplete, '=') << std::string(numRemaining, ' ') << "] " << std::setw(3) << progress << "%" << std::flush;
-							std::cout << "\033[A";
-						}
+				for (const auto& path : generatedPaths[directory]) {
+					// calculate the relative path with respect to the generation directory
+					std::string relativePath = std::filesystem::relative(path, generated).generic_string();
+					// Images are delivered as JPEG whatever the intermediate format
+					const std::string extension = path.extension().string();
+					if (ImageCodec::IsImageExtension(extension) && extension != ImageCodec::Extension(ImageCodec::Format::Jpeg))
+					{
+						const std::vector<uchar> buffer = ImageCodec::Encode(ImageCodec::Read(path.string()), ImageCodec::Format::Jpeg);
+						relativePath = std::filesystem::path(relativePath).replace_extension(ImageCodec::Extension(ImageCodec::Format::Jpeg)).generic_string();
+						zip.writestr(relativePath, std::string(buffer.begin(), buffer.end()));
+					}
+					else
+					{
+						zip.write(path.string(), relativePath);
+					}
+					{
+						std::lock_guard<std::mutex> lock(ImageUtils::mutex);
+						int progress = (++ImageUtils::progress) * 100 / ImageUtils::numComplete;
+						int numComplete = (progress * 50) / 100;
+						int numRemaining = 50 - numComplete;
+						std::cout << "\r\033[K" << "Compressed : " << relativePath << std::flush;
+						std::cout << "\n" << "[" << std::string(numComplete, '=') << std::string(numRemaining, ' ') << "] " << std::setw(3) << progress << "%" << std::flush;
+						std::cout << "\033[A";
 					}
 				}
 				zip.save(ModelUtils::targets[directory] + ".zip");
@@ -312,7 +395,7 @@ int main(int argc, char *argv[])
 	{
 		if (argc < 2)
 		{
-			throw std::runtime_error("Usage: " + (std::string)argv[0] + " <source_path> -gen <generation_max> -csv <csv_path>");
+			throw std::runtime_error("Usage: " + (std::string)argv[0] + " <source_path> -gen <generation_max> -data <dataset_path> -csv <csv_path>");
 		}
 		// Apple_Black_rot     620 files
 		// Apple_healthy       1640 files
@@ -323,13 +406,25 @@ int main(int argc, char *argv[])
 		// Grape_healthy       422 files
 		// Grape_spot          1075 files
 		std::string source = argv[1];
-		std::string csv; // = "data.csv";
+		std::string data; // Dataset to train from instead of generating one, binary or CSV
+		std::string csv;  // CSV export of the dataset
+		bool singlePrecision = false;
+		std::string store;
+		std::string cache = "features.LFC";
 		int generation = 500;
-		bool reset = true;
+		bool reset = false;
+		int shardIndex = 0;
+		int shardCount = 0; // Shard mode only describes one part of the samples
+		int mergeCount = 0; // Merge mode builds the dataset from the files of every shard
 
 		// Parse command-line arguments
 		for (int i = 2; i < argc; ++i)
 		{
+			// -orb, -kp, -seg and -segscale
+			if (!ImageProcessing::ParseFeatureArgument(argc, argv, i).empty())
+			{
+				continue;
+			}
 			std::string arg = argv[i];
 			if (arg == "-gen" && i + 1 < argc)
 			{
@@ -342,60 +437,237 @@ int main(int argc, char *argv[])
 			}
 			else if (arg == "-csv" && i + 1 < argc)
 			{
-				csv = arg[i + 1];
+				csv = argv[i + 1];
+				++i;
+			}
+			else if (arg == "-data" && i + 1 < argc)
+			{
+				data = argv[i + 1];
+				++i;
+			}
+			else if (arg == "-f32")
+			{
+				singlePrecision = true;
+			}
+			else if (arg == "-pack")
+			{
+				ImageUtils::packed = true;
+			}
+			else if (arg == "-fmt" && i + 1 < argc)
+			{
+				ImageUtils::format = ImageCodec::ParseFormat(argv[i + 1]);
+				++i;
+			}
+			else if (arg == "-store" && i + 1 < argc)
+			{
+				store = argv[i + 1];
+				++i;
+			}
+			else if (arg == "-cache" && i + 1 < argc)
+			{
+				cache = argv[i + 1];
+				++i;
+			}
+			else if (arg == "-reset")
+			{
+				reset = true;
+			}
+			else if (arg == "-softmax")
+			{
+				ModelCalculate::modelType = ModelUtils::ModelType::Softmax;
+			}
+			else if (arg == "-epochs" && i + 1 < argc)
+			{
+				ModelCalculate::epochs = std::max(1, std::atoi(argv[i + 1]));
+				++i;
+			}
+			else if (arg == "-batch" && i + 1 < argc)
+			{
+				ModelCalculate::batchSize = std::max(0, std::atoi(argv[i + 1]));
+				++i;
+			}
+			else if (arg == "-lr" && i + 1 < argc)
+			{
+				ModelCalculate::learningRate = std::atof(argv[i + 1]);
+				++i;
+			}
+			else if (arg == "-opt" && i + 1 < argc)
+			{
+				ModelCalculate::optimizer = ModelCalculate::ParseOptimizer(argv[i + 1]);
+				++i;
+			}
+			else if (arg == "-shard" && i + 1 < argc)
+			{
+				if (std::sscanf(argv[i + 1], "%d/%d", &shardIndex, &shardCount) != 2 || shardIndex < 0 || shardIndex >= shardCount)
+				{
+					throw std::runtime_error("Invalid shard " + std::string(argv[i + 1]) + ", expected <index>/<count>");
+				}
+				++i;
+			}
+			else if (arg == "-merge" && i + 1 < argc)
+			{
+				mergeCount = std::atoi(argv[i + 1]);
 				++i;
 			}
 			else if (arg == "-h")
 			{
-				std::cout << "Usage: " << argv[0] << " -gen <generation_max> -csv <csv_path> --data" << std::endl;
+				std::cout << "Usage: " << argv[0] << " -gen <generation_max> -data <dataset_path> -csv <csv_path> -f32 -orb <nfeatures> -kp -pack -fmt <jpg|png|raw|qoi> -store <store_path> -seg <heuristic|exg|exgr> -segscale <1|2|4> -reset -cache <cache_path> -shard <index>/<count> -merge <count> -softmax -epochs <count> -batch <size> -lr <rate> -opt <gd|momentum|adam|adagrad>" << std::endl;
 				return 0;
 			}
 		}
 
-		std::vector<DataEntry> database;
+		FeatureMatrix database;
+		FeatureStats stats;
+		// Settings the rows were extracted with, recorded in the dataset file and then in the models
+		std::string featureSettings;
 
-		// Get folder list
+		// Get folder list, in target order, from the dataset manifest
+		DatasetManifest::Open(source);
+		const std::vector<std::string> directories = DatasetManifest::Directories();
 		std::vector<std::filesystem::directory_entry> filesystemDirectories;
-		for (const auto &entry : std::filesystem::directory_iterator(source))
+		for (const auto &target : ModelUtils::targets)
 		{
-			const std::string directoryName = entry.path().filename().generic_string();
 			// Check only for expected directories
-			if (std::filesystem::is_directory(entry.path()) && std::find(ModelUtils::targets.begin(), ModelUtils::targets.end(), directoryName) == ModelUtils::targets.end())
+			if (std::find(directories.begin(), directories.end(), target) != directories.end())
 			{
-				continue;
+				filesystemDirectories.emplace_back(std::filesystem::path(source) / target);
+			}
+		}
+
+		// Generated images live in their own tree. A generating run builds a new one next to the published one,
+		// unchanged samples keep their images through hard links unless -reset starts from an empty tree
+		std::string generated = GenerationTree::Current(source);
+		const bool generating = data.empty() && shardCount == 0 && mergeCount == 0;
+		const std::string previous = reset ? "" : generated;
+		if (generating)
+		{
+			generated = GenerationTree::Create(source);
+		}
+		std::vector<std::filesystem::directory_entry> generatedDirectories;
+		size_t carried = 0;
+		for (const auto &directory : filesystemDirectories)
+		{
+			if (!generated.empty())
+			{
+				const std::string name = directory.path().filename().string();
+				std::filesystem::create_directories(generated + name);
+				generatedDirectories.emplace_back(generated + name);
+				if (generating && !previous.empty() && std::filesystem::is_directory(previous + name))
+				{
+					carried += ImageDependencies::Carry(previous + name + "/", generated + name + "/");
+				}
 			}
-			filesystemDirectories.push_back(entry);
+		}
+		if (carried > 0)
+		{
+			std::cout << "Unchanged samples linked : " << carried << std::endl;
 		}
 
-		if (csv.empty())
+		if (shardCount > 0)
+		{
+			// Images come from the published generation, a shard process only extracts features
+			if (generated.empty())
+			{
+				throw std::runtime_error("No published generation under " + source + ", run once without -shard");
+			}
+			if (!store.empty() && std::filesystem::exists(store))
+			{
+				ImageStore::Open(store);
+			}
+			FeatureCache::Open(cache);
+			{
+				const std::string shard = ShardName(shardIndex, shardCount);
+				DatasetWriter writer(shard + ModelUtils::DatasetExtension, singlePrecision, ImageProcessing::FeatureSettings());
+				GenerateDatabase(source, generated, writer, generation * 7, shardIndex, shardCount);
+				writer.Close();
+				writer.Stats().Save(shard + FeatureStats::Extension);
+			}
+			FeatureCache::Close();
+			DatasetManifest::Close();
+			return 0;
+		}
+		if (mergeCount > 0)
+		{
+			// Shards in order give the rows of a single run, their statistics merge without another pass
+			for (int shard = 0; shard < mergeCount; shard++)
+			{
+				std::string shardSettings;
+				ModelUtils::LoadDataset(database, ShardName(shard, mergeCount) + ModelUtils::DatasetExtension, shardSettings);
+				if (shard > 0 && shardSettings != featureSettings)
+				{
+					throw std::runtime_error("Shard " + ShardName(shard, mergeCount) + " was extracted with features \"" + shardSettings + "\", shard " + ShardName(0, mergeCount) + " with \"" + featureSettings + "\"");
+				}
+				featureSettings = shardSettings;
+				stats.Merge(FeatureStats::Load(ShardName(shard, mergeCount) + FeatureStats::Extension));
+			}
+			ModelUtils::SaveDataset("data" + ModelUtils::DatasetExtension, database, singlePrecision, featureSettings);
+		}
+		else if (data.empty())
 		{
 			auto start_time = std::chrono::high_resolution_clock::now();
 
 			std::cout << "Images generation..." << std::endl;
-			if (reset == true)
+			// Decoded source images, built once and mapped by later runs
+			if (!store.empty())
 			{
-				DeleteExistingImages(filesystemDirectories);
-				GenerateAugmentations(filesystemDirectories, generation);
-				GenerateTransformations(filesystemDirectories, generation);
+				if (!std::filesystem::exists(store))
+				{
+					BuildImageStore(filesystemDirectories, store);
+				}
+				ImageStore::Open(store);
+			}
+			// Feature rows and leaf masks of unchanged images are read back instead of computed
+			FeatureCache::Open(cache);
+			// Only samples whose source or settings changed are generated again
+			GenerateAugmentations(filesystemDirectories, generatedDirectories, generation);
+			RemoveStaleImages(generatedDirectories, 'A');
+			GenerateTransformations(filesystemDirectories, generatedDirectories, generation);
+			RemoveStaleImages(generatedDirectories, 'T');
+			// The new tree replaces the previous one in a single rename, the old one is removed meanwhile
+			GenerationTree::Publish(source, generated);
+			GenerationTree::Reclaim(source);
+			// Rows go to the dataset file as they are produced, then the whole file is loaded for training
+			{
+				DatasetWriter writer("data" + ModelUtils::DatasetExtension, singlePrecision, ImageProcessing::FeatureSettings());
+				GenerateDatabase(source, generated, writer, generation * 7);
+				writer.Close();
+				stats = writer.Stats();
 			}
-			GenerateDatabase(source, database, generation * 7);
-			ModelUtils::SaveDataFile("data.csv", database);
+			FeatureCache::Close();
+			ModelUtils::LoadDataset(database, "data" + ModelUtils::DatasetExtension, featureSettings);
 
 			auto end_time = std::chrono::high_resolution_clock::now();
 			auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
 			std::cout << "\r\033[K"
 					  << "Images generation took " << duration * 0.000001 << " seconds." << std::endl;
 		}
+		else if (ModelUtils::IsDataset(data))
+		{
+			ModelUtils::LoadDataset(database, data, featureSettings);
+		}
 		else
 		{
-			ModelUtils::LoadDataFile(database, csv);
+			ModelUtils::LoadDataFile(database, data);
+		}
+		if (!csv.empty())
+		{
+			ModelUtils::SaveDataFile(csv, database);
 		}
 
 		auto start_time = std::chrono::high_resolution_clock::now();
 
-		std::vector<std::vector<double>> weights(ModelUtils::targets.size(), std::vector<double>(database[0].features.size(), 0.0));
+		if (database.Empty())
+		{
+			throw std::runtime_error("Empty dataset");
+		}
+		std::vector<std::vector<double>> weights(ModelUtils::targets.size(), std::vector<double>(database.Cols(), 0.0));
+		// Statistics of a loaded dataset are accumulated in one parallel pass
+		if (stats.Count() != database.Rows())
+		{
+			stats = FeatureStats::Compute(database);
+		}
 		std::vector<double> featureMeans, featureStdDevs;
-		ModelCalculate::GenerateModels(database, weights, featureMeans, featureStdDevs);
+		ModelCalculate::GenerateModels(database, stats, weights, featureMeans, featureStdDevs);
 
 		auto end_time = std::chrono::high_resolution_clock::now();
 		auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
@@ -404,16 +676,23 @@ int main(int argc, char *argv[])
 
 		// ZIP
 		std::cout << "ZIP generation..." << std::endl;
-		std::string models = ModelUtils::SaveModels(weights, featureMeans, featureStdDevs);
-		GenerateZip(filesystemDirectories, source, models);
+		if (featureSettings.empty())
+		{
+			std::cerr << "Feature settings of the dataset are unknown, models.txt does not record them" << std::endl;
+		}
+		std::string models = ModelUtils::SaveModels(weights, featureMeans, featureStdDevs, ModelCalculate::modelType, featureSettings);
+		GenerateZip(generatedDirectories, generated, models);
 		std::cout << "\r\033[K"
 				  << "\033[A"
 				  << "\r\033[K"
 				  << "ZIP generated." << std::endl;
+		DatasetManifest::Close();
+		GenerationTree::Wait();
 	}
 	catch (const std::exception &e)
 	{
 		std::cerr << e.what() << std::endl;
+		GenerationTree::Wait();
 		return 1;
 	}
 	return 0;
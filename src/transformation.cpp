@@ -1,5 +1,6 @@
 #include "image_processing.h"
 #include "image_utils.h"
+#include "dataset_manifest.h"
 
 #include <iostream>
 #include <fstream>
@@ -127,7 +128,7 @@ void display(const std::string &source)
 	cv::waitKey(0);
 }
 
-void transformation(const std::string &source, const std::string &destination, int generation)
+void transformation(const std::string &source, const std::string &destination, int generation, ImageCodec::Format format)
 {
 	// Check if destination already exists
 	if (std::filesystem::exists(destination))
@@ -176,8 +177,8 @@ void transformation(const std::string &source, const std::string &destination, i
 		const std::string imgName = destinationPath.substr(lastSlashPos + 1, lastPointPos - lastSlashPos - 1);
 		for (size_t i = 0; i < images.size(); i++)
 		{
-			const std::string outputFilename = saveDir + imgName + "_" + transformations[i] + ".JPG";
-			cv::imwrite(outputFilename, images[i], {cv::IMWRITE_JPEG_QUALITY, 100});
+			const std::string outputFilename = saveDir + imgName + "_" + transformations[i] + ImageCodec::Extension(format);
+			ImageCodec::Write(outputFilename, images[i], format, 100);
 			std::cout << "\r\033[K"
 					  << "Saved : " << outputFilename << std::flush;
 		}
@@ -198,7 +199,7 @@ int main(int argc, char *argv[])
 	{
 		if (argc < 2)
 		{
-			throw std::runtime_error("Usage: " + (std::string)argv[0] + " <source_path> -dst <destination_path> -gen <num_generations>");
+			throw std::runtime_error("Usage: " + (std::string)argv[0] + " <source_path> -dst <destination_path> -gen <num_generations> -fmt <jpg|png|raw|qoi>");
 		}
 		// Apple_Black_rot     620 files
 		// Apple_healthy       1640 files
@@ -211,10 +212,16 @@ int main(int argc, char *argv[])
 		std::string source = argv[1];
 		std::string destination = "images/transformed_directory/";
 		int generation = 1640;
+		ImageCodec::Format format = ImageCodec::Format::Jpeg;
 
 		// Parse command-line arguments
 		for (int i = 1; i < argc; ++i)
 		{
+			// -orb, -kp, -seg and -segscale
+			if (!ImageProcessing::ParseFeatureArgument(argc, argv, i).empty())
+			{
+				continue;
+			}
 			std::string arg = argv[i];
 			if (arg == "-dst" && i + 1 < argc)
 			{
@@ -230,9 +237,14 @@ int main(int argc, char *argv[])
 				}
 				++i;
 			}
+			else if (arg == "-fmt" && i + 1 < argc)
+			{
+				format = ImageCodec::ParseFormat(argv[i + 1]);
+				++i;
+			}
 			else if (arg == "-h")
 			{
-				std::cout << "Usage: " << argv[0] << " <source_path> -dst <destination_path> -gen <num_generations>" << std::endl;
+				std::cout << "Usage: " << argv[0] << " <source_path> -dst <destination_path> -gen <num_generations> -fmt <jpg|png|raw|qoi> -orb <nfeatures> -kp -seg <heuristic|exg|exgr> -segscale <1|2|4>" << std::endl;
 				return 0;
 			}
 		}
@@ -250,7 +262,9 @@ int main(int argc, char *argv[])
 			{
 				destination += "/";
 			}
-			transformation(source, destination, generation);
+			DatasetManifest::Open(source);
+			transformation(source, destination, generation, format);
+			DatasetManifest::Close();
 		}
 	}
 	catch (const std::exception &e)
@@ -0,0 +1,54 @@
+#include "vector_kernels.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define VECTOR_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define VECTOR_KERNEL
+#endif
+
+VECTOR_KERNEL double VectorKernels::Dot(const double* a, const double* b, size_t size)
+{
+	double sum = 0.0;
+#pragma omp simd reduction(+ : sum)
+	for (size_t i = 0; i < size; i++)
+	{
+		sum += a[i] * b[i];
+	}
+	return sum;
+}
+
+VECTOR_KERNEL void VectorKernels::Axpy(double alpha, const double* x, double* y, size_t size)
+{
+#pragma omp simd
+	for (size_t i = 0; i < size; i++)
+	{
+		y[i] += alpha * x[i];
+	}
+}
+
+VECTOR_KERNEL void VectorKernels::Gemv(const double* matrix, size_t rows, size_t cols, const double* x, double* y)
+{
+	// Row-major matrix, four rows per pass so each element of x is loaded once for all of them
+	size_t row = 0;
+	for (; row + 4 <= rows; row += 4)
+	{
+		const double* a = matrix + row * cols;
+		double sum0 = 0.0, sum1 = 0.0, sum2 = 0.0, sum3 = 0.0;
+#pragma omp simd reduction(+ : sum0, sum1, sum2, sum3)
+		for (size_t i = 0; i < cols; i++)
+		{
+			sum0 += a[i] * x[i];
+			sum1 += a[cols + i] * x[i];
+			sum2 += a[2 * cols + i] * x[i];
+			sum3 += a[3 * cols + i] * x[i];
+		}
+		y[row] = sum0;
+		y[row + 1] = sum1;
+		y[row + 2] = sum2;
+		y[row + 3] = sum3;
+	}
+	for (; row < rows; row++)
+	{
+		y[row] = VectorKernels::Dot(matrix + row * cols, x, cols);
+	}
+}